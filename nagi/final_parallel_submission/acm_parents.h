@@ -0,0 +1,137 @@
+/**
+ * Packed ACM parent table
+ * Amolak Nagi and James Mackaman
+ *
+ * With -backtrack parents, while the ACM is computed we note for every
+ * entry which of the three entries above it the cheapest path came from,
+ * so generateSeam can walk a seam up without looking at the ACM again (and
+ * the ACM doesn't have to be kept):
+ *
+ *     0 = up and left, 1 = straight up, 2 = up and right
+ *
+ * (see acmParentDirection in acm_simd.h, whose kernels work these out).
+ * That's 2 bits an entry, packed 32 to a uint64_t with column 0 in the
+ * lowest bits. Like the other buffers' rows, each row starts on a new 64
+ * byte cache line, rowWords words apart, so a 1080p image's whole table is
+ * about half a megabyte.
+ *
+ * The ACM sweep computes a row in spans on different threads, and two spans
+ * can share a word. Words a span covers completely are just stored, and
+ * the ones at its ends are merged in atomically, so the spans never trip
+ * over each other's bits.
+ */
+
+#ifndef __ACM_PARENTS_H__
+#define __ACM_PARENTS_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#define ACM_PARENT_BITS 2
+#define ACM_PARENTS_PER_WORD 32
+#define ACM_PARENTS_LINE_WORDS 8
+
+typedef struct
+{
+	uint64_t *words;
+	int rowWords;
+} acm_parents_t;
+
+
+// Allocates a parent table for an ACM width entries wide, all zero.
+// words is NULL if it can't be allocated.
+static inline acm_parents_t acm_parents_alloc(int width, int height) {
+    acm_parents_t parents;
+    int words = (width + ACM_PARENTS_PER_WORD - 1) / ACM_PARENTS_PER_WORD;
+    parents.rowWords = ((words + ACM_PARENTS_LINE_WORDS - 1) / ACM_PARENTS_LINE_WORDS) * ACM_PARENTS_LINE_WORDS;
+
+    size_t bytes = sizeof(uint64_t) * (size_t)parents.rowWords * height;
+    void *table = NULL;
+    if (posix_memalign(&table, ACM_PARENTS_LINE_WORDS * sizeof(uint64_t), bytes) != 0) {
+        table = NULL;
+    } else {
+        memset(table, 0, bytes);
+    }
+    parents.words = (uint64_t *)table;
+    return parents;
+}
+
+static inline void acm_parents_free(acm_parents_t *parents) {
+    free(parents->words);
+    parents->words = NULL;
+}
+
+
+// Packs 8 directions, a byte each, into 16 bits: each step moves every
+// other group down next to the one before it.
+static inline uint64_t acm_parents_pack8(const uint8_t *directions) {
+    uint64_t bytes;
+    memcpy(&bytes, directions, sizeof(bytes));
+    bytes = (bytes | (bytes >> 6)) & 0x000F000F000F000FULL;
+    bytes = (bytes | (bytes >> 12)) & 0x000000FF000000FFULL;
+    return (bytes | (bytes >> 24)) & 0xFFFFULL;
+}
+
+
+// Stores the directions of columns [colLow, colHigh) of a row, where
+// directions[0] is column colLow's.
+static inline void acm_parents_store(acm_parents_t *parents, int row, int colLow, int colHigh,
+                                     const uint8_t *directions) {
+    uint64_t *rowWords = parents->words + ((size_t)row * parents->rowWords);
+    int col = colLow;
+    while (col < colHigh) {
+        int word = col / ACM_PARENTS_PER_WORD;
+        int wordStart = word * ACM_PARENTS_PER_WORD;
+        int wordEnd = std::min(colHigh, wordStart + ACM_PARENTS_PER_WORD);
+
+        // A whole word's worth, 8 columns at a time.
+        if (col == wordStart && wordEnd == (wordStart + ACM_PARENTS_PER_WORD)) {
+            const uint8_t *words = directions + (col - colLow);
+            rowWords[word] = acm_parents_pack8(words) | (acm_parents_pack8(words + 8) << 16) |
+                             (acm_parents_pack8(words + 16) << 32) | (acm_parents_pack8(words + 24) << 48);
+            col = wordEnd;
+            continue;
+        }
+
+        uint64_t bits = 0;
+        uint64_t mask = 0;
+        for (; col < wordEnd; col++) {
+            int shift = ACM_PARENT_BITS * (col % ACM_PARENTS_PER_WORD);
+            bits |= ((uint64_t)directions[col - colLow]) << shift;
+            mask |= ((uint64_t)3) << shift;
+        }
+        __atomic_fetch_and(&rowWords[word], ~mask, __ATOMIC_RELAXED);
+        __atomic_fetch_or(&rowWords[word], bits, __ATOMIC_RELAXED);
+    }
+}
+
+
+static inline int acm_parent(const acm_parents_t *parents, int row, int col) {
+    uint64_t word = parents->words[((size_t)row * parents->rowWords) + (col / ACM_PARENTS_PER_WORD)];
+    return (int)((word >> (ACM_PARENT_BITS * (col % ACM_PARENTS_PER_WORD))) & 3);
+}
+
+
+// Takes column col out of a row of a table width entries wide, sliding the
+// entries right of it one to the left.
+static inline void acm_parents_remove_column(acm_parents_t *parents, int row, int col, int width) {
+    uint64_t *rowWords = parents->words + ((size_t)row * parents->rowWords);
+    int word = col / ACM_PARENTS_PER_WORD;
+    int lastWord = (width - 1) / ACM_PARENTS_PER_WORD;
+
+    // Below col stays put, and col's word loses col.
+    uint64_t keep = (((uint64_t)1) << (ACM_PARENT_BITS * (col % ACM_PARENTS_PER_WORD))) - 1;
+    uint64_t shifted = (rowWords[word] >> ACM_PARENT_BITS) & ~keep;
+    rowWords[word] = (rowWords[word] & keep) | shifted;
+
+    // Every later word moves down one entry, with its lowest entry going
+    // to the top of the word before.
+    for (; word < lastWord; word++) {
+        rowWords[word] |= rowWords[word + 1] << (64 - ACM_PARENT_BITS);
+        rowWords[word + 1] >>= ACM_PARENT_BITS;
+    }
+}
+
+#endif /* __ACM_PARENTS_H__ */
@@ -0,0 +1,317 @@
+/**
+ * SIMD ACM row kernels
+ * Amolak Nagi and James Mackaman
+ *
+ * Every row of the ACM is the row's energy plus the smallest of the three
+ * ACM entries above each pixel:
+ *
+ *     row[col] += min(above[col-1], above[col], above[col+1])
+ *
+ * which is three shifted loads of the row above, two packed mins and a
+ * packed add. These kernels do that for a span of columns with AVX2 (4
+ * doubles, 8 floats or 8 uint32_ts at a time) or AVX-512 (twice that), and
+ * the scalar one finishes off the end of the span and runs everywhere else
+ * (including the Xeon Phi build).
+ *
+ * With -backtrack parents, a second set of kernels also notes which of the
+ * three entries above was the smallest (the entry's parent, see
+ * acm_parents.h) as a byte per column. The SIMD ones get that from packed
+ * compares of the vectors they already have loaded, turned into bitmasks.
+ *
+ * The ACM's edge columns hold the largest cost as a sentinel, so the
+ * columns next to the edges need no special case: min never picks the
+ * edge. min and add are exact, so every kernel gives exactly the same ACM.
+ *
+ * The kernel is picked once at startup from what CPUID says the CPU supports.
+ */
+
+#ifndef __ACM_SIMD_H__
+#define __ACM_SIMD_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__MIC__)
+#define ACM_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Computes columns [colLow, colHigh) of an ACM row from the row above it.
+template <typename cost_t>
+using acm_kernel_t = void (*)(const cost_t *above, cost_t *row, int colLow, int colHigh);
+
+enum AcmKernel { acmKernelScalar, acmKernelAVX2, acmKernelAVX512, acmKernelCount };
+
+static const char *acmKernelNames[acmKernelCount] = { "scalar", "avx2", "avx512" };
+
+// The same, and each column's parent in directions[col - colLow].
+template <typename cost_t>
+using acm_parent_kernel_t = void (*)(const cost_t *above, cost_t *row, uint8_t *directions,
+                                     int colLow, int colHigh);
+
+// Which of the three entries above an ACM entry its cheapest path came from.
+enum AcmParent { acmParentUpLeft, acmParentUp, acmParentUpRight };
+
+
+// The parent of an entry, breaking ties the way generateSeam always has:
+// up and left, then up and right, then straight up. Written without
+// branches, since which one wins is anyone's guess. (Up and right wins
+// when it's no bigger than up and up and left didn't win, which is when
+// it's smaller than up and left.)
+template <typename cost_t>
+inline uint8_t acmParentDirection(cost_t upLeft, cost_t up, cost_t upRight) {
+    int left = (upLeft <= up) & (upLeft <= upRight);
+    int right = (upRight <= up) & (upRight < upLeft);
+    return (uint8_t)(acmParentUp - left + right);
+}
+
+
+template <typename cost_t>
+static void acmRowScalar(const cost_t *above, cost_t *row, int colLow, int colHigh) {
+    for (int col = colLow; col < colHigh; col++) {
+        cost_t smallest = above[col-1];
+        if (above[col] < smallest) {
+            smallest = above[col];
+        }
+        if (above[col+1] < smallest) {
+            smallest = above[col+1];
+        }
+        row[col] = row[col] + smallest;
+    }
+}
+
+
+// The parent is always one of the three smallest, so it picks the min too.
+template <typename cost_t>
+static void acmRowParentsScalar(const cost_t *above, cost_t *row, uint8_t *directions,
+                                int colLow, int colHigh) {
+    for (int col = colLow; col < colHigh; col++) {
+        uint8_t direction = acmParentDirection(above[col-1], above[col], above[col+1]);
+        directions[col - colLow] = direction;
+        row[col] = row[col] + above[col - 1 + direction];
+    }
+}
+
+
+#ifdef ACM_SIMD
+
+// The AVX2 and AVX-512 kernels only differ in their types and intrinsics,
+// so they're stamped out from this. LANES is how many costs fit in a vector.
+#define ACM_ROW_KERNEL(NAME, TARGET, COST, VECTOR, LANES, LOAD, STORE, MIN, ADD)  \
+__attribute__((target(TARGET)))                                                 \
+static void NAME(const COST *above, COST *row, int colLow, int colHigh) {       \
+    int col = colLow;                                                           \
+    for (; (col + LANES) <= colHigh; col += LANES) {                            \
+        VECTOR upLeft = LOAD(above + col - 1);                                  \
+        VECTOR up = LOAD(above + col);                                          \
+        VECTOR upRight = LOAD(above + col + 1);                                 \
+        VECTOR smallest = MIN(MIN(upLeft, up), upRight);                        \
+        STORE(row + col, ADD(LOAD(row + col), smallest));                       \
+    }                                                                           \
+    acmRowScalar(above, row, col, colHigh);                                     \
+}
+
+// Bit i of a 4 bit mask spread out to byte i, for turning compare masks
+// into a byte per column.
+static const uint32_t acmMaskBytes[16] = {
+    0x00000000, 0x00000001, 0x00000100, 0x00000101, 0x00010000, 0x00010001, 0x00010100, 0x00010101,
+    0x01000000, 0x01000001, 0x01000100, 0x01000101, 0x01010000, 0x01010001, 0x01010100, 0x01010101
+};
+
+// Writes the parents of lanes columns from the masks of the lanes whose
+// parent is up and left and up and right (the rest are straight up).
+static inline void acmStoreDirections(uint8_t *directions, unsigned left, unsigned right, int lanes) {
+    for (int i = 0; i < lanes; i += 4) {
+        uint32_t bytes = 0x01010101 * acmParentUp + acmMaskBytes[(right >> i) & 15] -
+                         acmMaskBytes[(left >> i) & 15];
+        memcpy(directions + i, &bytes, sizeof(bytes));
+    }
+}
+
+// The parent noting version of ACM_ROW_KERNEL, where LE(a, b) gives a
+// bitmask of the lanes where a <= b.
+#define ACM_ROW_PARENTS_KERNEL(NAME, TARGET, COST, VECTOR, LANES, LOAD, STORE, MIN, ADD, LE)  \
+__attribute__((target(TARGET)))                                                 \
+static void NAME(const COST *above, COST *row, uint8_t *directions,             \
+                 int colLow, int colHigh) {                                     \
+    int col = colLow;                                                           \
+    for (; (col + LANES) <= colHigh; col += LANES) {                            \
+        VECTOR upLeft = LOAD(above + col - 1);                                  \
+        VECTOR up = LOAD(above + col);                                          \
+        VECTOR upRight = LOAD(above + col + 1);                                 \
+        VECTOR smallest = MIN(MIN(upLeft, up), upRight);                        \
+        STORE(row + col, ADD(LOAD(row + col), smallest));                       \
+                                                                                \
+        unsigned left = LE(upLeft, up) & LE(upLeft, upRight);                   \
+        unsigned right = LE(upRight, up) & ~left;                               \
+        acmStoreDirections(directions + (col - colLow), left, right, LANES);    \
+    }                                                                           \
+    acmRowParentsScalar(above, row, directions + (col - colLow), col, colHigh); \
+}
+
+#define ACM_LOAD_PD256(p) _mm256_loadu_pd(p)
+#define ACM_LOAD_PS256(p) _mm256_loadu_ps(p)
+#define ACM_LOAD_SI256(p) _mm256_loadu_si256((const __m256i *)(p))
+#define ACM_STORE_SI256(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define ACM_LOAD_PD512(p) _mm512_loadu_pd(p)
+#define ACM_LOAD_PS512(p) _mm512_loadu_ps(p)
+#define ACM_LOAD_SI512(p) _mm512_loadu_si512((const void *)(p))
+#define ACM_STORE_SI512(p, v) _mm512_storeu_si512((void *)(p), v)
+#define ACM_LE_PD256(a, b) (unsigned)_mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ))
+#define ACM_LE_PS256(a, b) (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ))
+#define ACM_LE_EPU32_256(a, b) \
+    (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_min_epu32(a, b), a)))
+#define ACM_LE_PD512(a, b) (unsigned)_mm512_cmp_pd_mask(a, b, _CMP_LE_OQ)
+#define ACM_LE_PS512(a, b) (unsigned)_mm512_cmp_ps_mask(a, b, _CMP_LE_OQ)
+#define ACM_LE_EPU32_512(a, b) (unsigned)_mm512_cmple_epu32_mask(a, b)
+
+ACM_ROW_KERNEL(acmRowAVX2Double, "avx2", double, __m256d, 4,
+               ACM_LOAD_PD256, _mm256_storeu_pd, _mm256_min_pd, _mm256_add_pd)
+ACM_ROW_KERNEL(acmRowAVX2Float, "avx2", float, __m256, 8,
+               ACM_LOAD_PS256, _mm256_storeu_ps, _mm256_min_ps, _mm256_add_ps)
+ACM_ROW_KERNEL(acmRowAVX2Uint32, "avx2", uint32_t, __m256i, 8,
+               ACM_LOAD_SI256, ACM_STORE_SI256, _mm256_min_epu32, _mm256_add_epi32)
+ACM_ROW_PARENTS_KERNEL(acmRowParentsAVX2Double, "avx2", double, __m256d, 4,
+                       ACM_LOAD_PD256, _mm256_storeu_pd, _mm256_min_pd, _mm256_add_pd, ACM_LE_PD256)
+ACM_ROW_PARENTS_KERNEL(acmRowParentsAVX2Float, "avx2", float, __m256, 8,
+                       ACM_LOAD_PS256, _mm256_storeu_ps, _mm256_min_ps, _mm256_add_ps, ACM_LE_PS256)
+ACM_ROW_PARENTS_KERNEL(acmRowParentsAVX2Uint32, "avx2", uint32_t, __m256i, 8,
+                       ACM_LOAD_SI256, ACM_STORE_SI256, _mm256_min_epu32, _mm256_add_epi32, ACM_LE_EPU32_256)
+
+// GCC's AVX-512 headers start some intrinsics from an undefined vector,
+// which -Wmaybe-uninitialized mistakes for a bug in our code.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+ACM_ROW_KERNEL(acmRowAVX512Double, "avx512f", double, __m512d, 8,
+               ACM_LOAD_PD512, _mm512_storeu_pd, _mm512_min_pd, _mm512_add_pd)
+ACM_ROW_KERNEL(acmRowAVX512Float, "avx512f", float, __m512, 16,
+               ACM_LOAD_PS512, _mm512_storeu_ps, _mm512_min_ps, _mm512_add_ps)
+ACM_ROW_KERNEL(acmRowAVX512Uint32, "avx512f", uint32_t, __m512i, 16,
+               ACM_LOAD_SI512, ACM_STORE_SI512, _mm512_min_epu32, _mm512_add_epi32)
+ACM_ROW_PARENTS_KERNEL(acmRowParentsAVX512Double, "avx512f", double, __m512d, 8,
+                       ACM_LOAD_PD512, _mm512_storeu_pd, _mm512_min_pd, _mm512_add_pd, ACM_LE_PD512)
+ACM_ROW_PARENTS_KERNEL(acmRowParentsAVX512Float, "avx512f", float, __m512, 16,
+                       ACM_LOAD_PS512, _mm512_storeu_ps, _mm512_min_ps, _mm512_add_ps, ACM_LE_PS512)
+ACM_ROW_PARENTS_KERNEL(acmRowParentsAVX512Uint32, "avx512f", uint32_t, __m512i, 16,
+                       ACM_LOAD_SI512, ACM_STORE_SI512, _mm512_min_epu32, _mm512_add_epi32, ACM_LE_EPU32_512)
+#pragma GCC diagnostic pop
+
+#endif /* ACM_SIMD */
+
+
+// Returns true if this build and this CPU can run the kernel.
+static inline bool acmKernelAvailable(int kernel) {
+    switch (kernel) {
+        case acmKernelScalar:
+            return true;
+#ifdef ACM_SIMD
+        case acmKernelAVX2:
+            return __builtin_cpu_supports("avx2");
+        case acmKernelAVX512:
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+    }
+}
+
+template <typename cost_t> inline acm_kernel_t<cost_t> acmKernelFunction(int kernel) {
+    return acmRowScalar<cost_t>;
+}
+
+#ifdef ACM_SIMD
+template <> inline acm_kernel_t<double> acmKernelFunction<double>(int kernel) {
+    switch (kernel) {
+        case acmKernelAVX2:
+            return acmRowAVX2Double;
+        case acmKernelAVX512:
+            return acmRowAVX512Double;
+        default:
+            return acmRowScalar<double>;
+    }
+}
+
+template <> inline acm_kernel_t<float> acmKernelFunction<float>(int kernel) {
+    switch (kernel) {
+        case acmKernelAVX2:
+            return acmRowAVX2Float;
+        case acmKernelAVX512:
+            return acmRowAVX512Float;
+        default:
+            return acmRowScalar<float>;
+    }
+}
+
+template <> inline acm_kernel_t<uint32_t> acmKernelFunction<uint32_t>(int kernel) {
+    switch (kernel) {
+        case acmKernelAVX2:
+            return acmRowAVX2Uint32;
+        case acmKernelAVX512:
+            return acmRowAVX512Uint32;
+        default:
+            return acmRowScalar<uint32_t>;
+    }
+}
+#endif
+
+template <typename cost_t> inline acm_parent_kernel_t<cost_t> acmParentKernelFunction(int kernel) {
+    return acmRowParentsScalar<cost_t>;
+}
+
+#ifdef ACM_SIMD
+template <> inline acm_parent_kernel_t<double> acmParentKernelFunction<double>(int kernel) {
+    switch (kernel) {
+        case acmKernelAVX2:
+            return acmRowParentsAVX2Double;
+        case acmKernelAVX512:
+            return acmRowParentsAVX512Double;
+        default:
+            return acmRowParentsScalar<double>;
+    }
+}
+
+template <> inline acm_parent_kernel_t<float> acmParentKernelFunction<float>(int kernel) {
+    switch (kernel) {
+        case acmKernelAVX2:
+            return acmRowParentsAVX2Float;
+        case acmKernelAVX512:
+            return acmRowParentsAVX512Float;
+        default:
+            return acmRowParentsScalar<float>;
+    }
+}
+
+template <> inline acm_parent_kernel_t<uint32_t> acmParentKernelFunction<uint32_t>(int kernel) {
+    switch (kernel) {
+        case acmKernelAVX2:
+            return acmRowParentsAVX2Uint32;
+        case acmKernelAVX512:
+            return acmRowParentsAVX512Uint32;
+        default:
+            return acmRowParentsScalar<uint32_t>;
+    }
+}
+#endif
+
+// The fastest kernel this CPU supports.
+static inline int bestAcmKernel() {
+    for (int kernel = acmKernelCount - 1; kernel > acmKernelScalar; kernel--) {
+        if (acmKernelAvailable(kernel)) {
+            return kernel;
+        }
+    }
+    return acmKernelScalar;
+}
+
+// Looks a kernel up by name. Returns -1 if there's no such kernel.
+static inline int acmKernelFromName(const char *name) {
+    for (int kernel = 0; kernel < acmKernelCount; kernel++) {
+        if (!strcasecmp(name, acmKernelNames[kernel])) {
+            return kernel;
+        }
+    }
+    return -1;
+}
+
+#endif /* __ACM_SIMD_H__ */
@@ -0,0 +1,249 @@
+/**
+ * SIMD energy kernels
+ * Amolak Nagi and James Mackaman
+ *
+ * The inner loop of our energy calculation takes, for every interior pixel
+ * of a row, the absolute difference between its left and right neighbors
+ * in each channel and sums the three. These kernels do that for two rows of
+ * packed RGB pixels, a and b, giving for each column
+ *
+ *     delta[col] = |a[col].r - b[col].r| + |a[col].g - b[col].g| + |a[col].b - b[col].b|
+ *
+ * so the horizontal gradient is a = the row shifted one pixel left and
+ * b = the row shifted one pixel right. Forward energy uses the same kernels
+ * to compare a row against the one above it.
+ *
+ * The SSE4.1 kernel does 16 pixels at a time and the AVX2 one 32. Each
+ * loads both rows, de-interleaves them into R, G and B vectors with byte
+ * shuffles, takes the absolute differences with saturating byte subtracts,
+ * and widens to 16 bits to sum the channels. The scalar kernel handles what's
+ * left at the end of a row and is the fallback everywhere else (including the
+ * Xeon Phi build).
+ *
+ * The kernel is picked once at startup from what CPUID says the CPU supports.
+ */
+
+#ifndef __ENERGY_SIMD_H__
+#define __ENERGY_SIMD_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__MIC__)
+#define ENERGY_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Computes delta for columns 1 to width - 2 between two rows of packed RGB
+// bytes. delta[0] and delta[width - 1] are left alone.
+typedef void (*energy_kernel_t)(const uint8_t *a, const uint8_t *b, uint16_t *delta, int width);
+
+enum EnergyKernel { energyKernelScalar, energyKernelSSE41, energyKernelAVX2, energyKernelCount };
+
+static const char *energyKernelNames[energyKernelCount] = { "scalar", "sse4.1", "avx2" };
+
+
+// Plain C kernel for columns [colLow, width - 2].
+static inline void energyDeltasScalarFrom(const uint8_t *a, const uint8_t *b, uint16_t *delta,
+                                          int width, int colLow) {
+    for (int col = colLow; col < (width - 1); col++) {
+        const uint8_t *pa = a + (3 * col);
+        const uint8_t *pb = b + (3 * col);
+
+        int rdx = abs(pa[0] - pb[0]);
+        int gdx = abs(pa[1] - pb[1]);
+        int bdx = abs(pa[2] - pb[2]);
+
+        delta[col] = (uint16_t)(rdx + gdx + bdx);
+    }
+}
+
+static void energyDeltasScalar(const uint8_t *a, const uint8_t *b, uint16_t *delta, int width) {
+    energyDeltasScalarFrom(a, b, delta, width, 1);
+}
+
+
+#ifdef ENERGY_SIMD
+
+// pshufb masks that pull channel c of 16 packed pixels out of the three
+// 16 byte blocks they span. Pixel p's channel c is byte 3p + c, so block k
+// supplies it if that byte falls inside it, and everything else is zeroed
+// (0x80) so the three shuffles can just be OR'd together.
+struct deinterleave_masks_t
+{
+	uint8_t mask[3][3][16];
+
+	deinterleave_masks_t() {
+		for (int channel = 0; channel < 3; channel++) {
+			for (int block = 0; block < 3; block++) {
+				for (int p = 0; p < 16; p++) {
+					int byte = (3 * p) + channel - (16 * block);
+					mask[channel][block][p] = (byte >= 0 && byte < 16) ? (uint8_t)byte : 0x80;
+				}
+			}
+		}
+	}
+};
+
+static const deinterleave_masks_t deinterleaveMasks;
+
+
+__attribute__((target("sse4.1")))
+static inline __m128i deinterleaveSSE(__m128i a, __m128i b, __m128i c, int channel) {
+    const uint8_t (*masks)[16] = deinterleaveMasks.mask[channel];
+    __m128i fromA = _mm_shuffle_epi8(a, _mm_loadu_si128((const __m128i *)masks[0]));
+    __m128i fromB = _mm_shuffle_epi8(b, _mm_loadu_si128((const __m128i *)masks[1]));
+    __m128i fromC = _mm_shuffle_epi8(c, _mm_loadu_si128((const __m128i *)masks[2]));
+    return _mm_or_si128(_mm_or_si128(fromA, fromB), fromC);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i absDiffSSE(__m128i a, __m128i b) {
+    return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+__attribute__((target("sse4.1")))
+static void energyDeltasSSE41(const uint8_t *a, const uint8_t *b, uint16_t *delta, int width) {
+    const int pixels = 16;
+    int col = 1;
+
+    // A block reads up to pixel col + pixels - 1, which has to stay inside
+    // the interior of the row.
+    for (; (col + pixels) <= (width - 1); col += pixels) {
+        const uint8_t *pa = a + (3 * col);
+        const uint8_t *pb = b + (3 * col);
+
+        __m128i aA = _mm_loadu_si128((const __m128i *)pa);
+        __m128i aB = _mm_loadu_si128((const __m128i *)(pa + 16));
+        __m128i aC = _mm_loadu_si128((const __m128i *)(pa + 32));
+        __m128i bA = _mm_loadu_si128((const __m128i *)pb);
+        __m128i bB = _mm_loadu_si128((const __m128i *)(pb + 16));
+        __m128i bC = _mm_loadu_si128((const __m128i *)(pb + 32));
+
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        for (int channel = 0; channel < 3; channel++) {
+            __m128i diff = absDiffSSE(deinterleaveSSE(aA, aB, aC, channel),
+                                      deinterleaveSSE(bA, bB, bC, channel));
+            lo = _mm_add_epi16(lo, _mm_cvtepu8_epi16(diff));
+            hi = _mm_add_epi16(hi, _mm_cvtepu8_epi16(_mm_srli_si128(diff, 8)));
+        }
+
+        _mm_storeu_si128((__m128i *)(delta + col), lo);
+        _mm_storeu_si128((__m128i *)(delta + col + 8), hi);
+    }
+
+    energyDeltasScalarFrom(a, b, delta, width, col);
+}
+
+
+// AVX2 byte shuffles only work within each 128 bit lane, so we load 32
+// pixels as two groups of 16: the low lane gets bytes 0-47 and the high
+// lane bytes 48-95, and the same masks as the SSE kernel work on both.
+__attribute__((target("avx2")))
+static inline __m256i loadLanesAVX2(const uint8_t *bytes) {
+    __m128i low = _mm_loadu_si128((const __m128i *)bytes);
+    __m128i high = _mm_loadu_si128((const __m128i *)(bytes + 48));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i deinterleaveAVX2(__m256i a, __m256i b, __m256i c, int channel) {
+    const uint8_t (*masks)[16] = deinterleaveMasks.mask[channel];
+    __m256i maskA = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)masks[0]));
+    __m256i maskB = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)masks[1]));
+    __m256i maskC = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)masks[2]));
+    __m256i fromA = _mm256_shuffle_epi8(a, maskA);
+    __m256i fromB = _mm256_shuffle_epi8(b, maskB);
+    __m256i fromC = _mm256_shuffle_epi8(c, maskC);
+    return _mm256_or_si256(_mm256_or_si256(fromA, fromB), fromC);
+}
+
+__attribute__((target("avx2")))
+static void energyDeltasAVX2(const uint8_t *a, const uint8_t *b, uint16_t *delta, int width) {
+    const int pixels = 32;
+    int col = 1;
+
+    for (; (col + pixels) <= (width - 1); col += pixels) {
+        const uint8_t *pa = a + (3 * col);
+        const uint8_t *pb = b + (3 * col);
+
+        __m256i aA = loadLanesAVX2(pa);
+        __m256i aB = loadLanesAVX2(pa + 16);
+        __m256i aC = loadLanesAVX2(pa + 32);
+        __m256i bA = loadLanesAVX2(pb);
+        __m256i bB = loadLanesAVX2(pb + 16);
+        __m256i bC = loadLanesAVX2(pb + 32);
+
+        __m256i lo = _mm256_setzero_si256();
+        __m256i hi = _mm256_setzero_si256();
+        for (int channel = 0; channel < 3; channel++) {
+            __m256i da = deinterleaveAVX2(aA, aB, aC, channel);
+            __m256i db = deinterleaveAVX2(bA, bB, bC, channel);
+            __m256i diff = _mm256_or_si256(_mm256_subs_epu8(da, db), _mm256_subs_epu8(db, da));
+            lo = _mm256_add_epi16(lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(diff)));
+            hi = _mm256_add_epi16(hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(diff, 1)));
+        }
+
+        _mm256_storeu_si256((__m256i *)(delta + col), lo);
+        _mm256_storeu_si256((__m256i *)(delta + col + 16), hi);
+    }
+
+    energyDeltasScalarFrom(a, b, delta, width, col);
+}
+
+#endif /* ENERGY_SIMD */
+
+
+// Returns true if this build and this CPU can run the kernel.
+static inline bool energyKernelAvailable(int kernel) {
+    switch (kernel) {
+        case energyKernelScalar:
+            return true;
+#ifdef ENERGY_SIMD
+        case energyKernelSSE41:
+            return __builtin_cpu_supports("sse4.1");
+        case energyKernelAVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+static inline energy_kernel_t energyKernelFunction(int kernel) {
+    switch (kernel) {
+#ifdef ENERGY_SIMD
+        case energyKernelSSE41:
+            return energyDeltasSSE41;
+        case energyKernelAVX2:
+            return energyDeltasAVX2;
+#endif
+        default:
+            return energyDeltasScalar;
+    }
+}
+
+// The fastest kernel this CPU supports.
+static inline int bestEnergyKernel() {
+    for (int kernel = energyKernelCount - 1; kernel > energyKernelScalar; kernel--) {
+        if (energyKernelAvailable(kernel)) {
+            return kernel;
+        }
+    }
+    return energyKernelScalar;
+}
+
+// Looks a kernel up by name. Returns -1 if there's no such kernel.
+static inline int energyKernelFromName(const char *name) {
+    for (int kernel = 0; kernel < energyKernelCount; kernel++) {
+        if (!strcasecmp(name, energyKernelNames[kernel])) {
+            return kernel;
+        }
+    }
+    return -1;
+}
+
+#endif /* __ENERGY_SIMD_H__ */
@@ -24,6 +24,13 @@
 #include <stdio.h>
 #include <png.h>
 #include <stdint.h>
+#include <setjmp.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 typedef struct image_pixels {
      int width;
@@ -160,3 +167,402 @@ void rgb_to_image(image_t image) {
 
      png_write_end(png, NULL);
 }
+
+
+// Lets a caller work on rows while the rest of the image is still being
+// decoded. begin is called once the size is known and returns the packed
+// RGB buffer to decode into (or NULL to give up). row is called every time
+// another row is complete, in order from the top.
+typedef struct {
+  uint8_t *(*begin)(void *context, int width, int height);
+  void (*row)(void *context, int row);
+  void *context;
+} png_row_listener_t;
+
+
+// Reads a PNG file straight into a packed, row-major RGB buffer (3 bytes per
+// pixel, the same layout as the pixel struct in wireroute.cpp) one row at a
+// time with png_read_row, so there's no per-row malloc and no de-interleave
+// pass. Palette, grayscale, 16 bit and alpha images are converted to 8 bit
+// RGB by libpng on the way in.
+//
+// With a listener, the buffer comes from listener->begin and stays owned by
+// the caller even if decoding fails. Without one, the buffer is allocated
+// here and the caller frees it.
+// Returns NULL if the file can't be read.
+uint8_t *png_to_packed_rgb_rows(const char *filename, int *width, int *height,
+                                const png_row_listener_t *listener) {
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) return NULL;
+
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = png ? png_create_info_struct(png) : NULL;
+  if (!info) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    fclose(fp);
+    return NULL;
+  }
+
+  // Written after setjmp, so it has to be volatile to survive the longjmp.
+  uint8_t *volatile rgb = NULL;
+  if (setjmp(png_jmpbuf(png))) {
+    if (!listener) free(rgb);
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fp);
+    return NULL;
+  }
+
+  png_init_io(png, fp);
+  png_read_info(png, info);
+
+  png_set_expand(png);
+  png_set_strip_16(png);
+  png_set_strip_alpha(png);
+  png_set_gray_to_rgb(png);
+  int passes = png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+
+  int w = png_get_image_width(png, info);
+  int h = png_get_image_height(png, info);
+  size_t stride = 3 * (size_t)w;
+
+  if (listener) {
+    rgb = listener->begin(listener->context, w, h);
+  } else {
+    rgb = (uint8_t*)calloc(stride * h, sizeof(uint8_t));
+  }
+  if (!rgb) png_error(png, "out of memory");
+
+  // Decode each row in place. Interlaced images take several passes over
+  // the same rows, which libpng merges for us, so a row is only complete
+  // once the last pass has been over it.
+  for (int pass = 0; pass < passes; pass++) {
+    bool lastPass = (pass == (passes - 1));
+    for (int row = 0; row < h; row++) {
+      png_read_row(png, (png_bytep)(rgb + (row * stride)), NULL);
+      if (listener && lastPass) listener->row(listener->context, row);
+    }
+  }
+
+  png_read_end(png, NULL);
+  png_destroy_read_struct(&png, &info, NULL);
+  fclose(fp);
+
+  *width = w;
+  *height = h;
+  return rgb;
+}
+
+// Reads a whole PNG file into a packed RGB buffer. See png_to_packed_rgb_rows.
+uint8_t *png_to_packed_rgb(const char *filename, int *width, int *height) {
+  return png_to_packed_rgb_rows(filename, width, height, NULL);
+}
+
+// Writes a packed, row-major RGB buffer (see png_to_packed_rgb) out as an
+// 8 bit RGB PNG called filename. Returns false if the file can't be written.
+bool packed_rgb_to_png(const uint8_t *rgb, int width, int height, const char *filename) {
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) return false;
+
+  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = png ? png_create_info_struct(png) : NULL;
+  if (!info) {
+    png_destroy_write_struct(&png, NULL);
+    fclose(fp);
+    return false;
+  }
+
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_write_struct(&png, &info);
+    fclose(fp);
+    return false;
+  }
+
+  png_init_io(png, fp);
+  png_set_IHDR(png, info, width, height,
+               8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+  png_write_info(png, info);
+
+  size_t stride = 3 * (size_t)width;
+  for (int row = 0; row < height; row++) {
+    png_write_row(png, (png_const_bytep)(rgb + (row * stride)));
+  }
+
+  png_write_end(png, NULL);
+  png_destroy_write_struct(&png, &info);
+  fclose(fp);
+  return true;
+}
+
+
+// Row filters for the parallel encoder. These match the PNG filter type
+// numbers, plus adaptive, which picks the best filter for each row the same
+// way libpng does (smallest sum of absolute filtered bytes).
+enum png_row_filter { PNG_ROW_FILTER_NONE = 0, PNG_ROW_FILTER_SUB, PNG_ROW_FILTER_UP,
+                      PNG_ROW_FILTER_AVG, PNG_ROW_FILTER_PAETH, PNG_ROW_FILTER_ADAPTIVE };
+
+// Settings for packed_rgb_to_png_parallel. level is the zlib level (0-9).
+typedef struct {
+  int level;
+  int filter;
+} png_encode_options_t;
+
+// Maps a filter name (none, sub, up, avg, paeth, adaptive) to its
+// png_row_filter. Returns -1 for anything else.
+int png_filter_from_name(const char *name) {
+  const char *names[] = { "none", "sub", "up", "avg", "paeth", "adaptive" };
+  for (int filter = 0; filter <= PNG_ROW_FILTER_ADAPTIVE; filter++) {
+    if (!strcasecmp(name, names[filter])) return filter;
+  }
+  return -1;
+}
+
+
+static inline uint8_t png_paeth_predictor(int left, int up, int upLeft) {
+  int p = left + up - upLeft;
+  int pLeft = abs(p - left);
+  int pUp = abs(p - up);
+  int pUpLeft = abs(p - upLeft);
+  if (pLeft <= pUp && pLeft <= pUpLeft) return (uint8_t)left;
+  if (pUp <= pUpLeft) return (uint8_t)up;
+  return (uint8_t)upLeft;
+}
+
+// Applies one PNG filter type to a row of packed RGB. above is NULL for the
+// first row. Writes the filter type byte followed by the filtered bytes to
+// out, and returns the sum of the filtered bytes taken as signed values.
+static size_t png_filter_row(const uint8_t *row, const uint8_t *above, size_t stride,
+                             int filter, uint8_t *out) {
+  const int bpp = 3;
+  size_t sum = 0;
+  out[0] = (uint8_t)filter;
+  for (size_t i = 0; i < stride; i++) {
+    int left = (i >= (size_t)bpp) ? row[i - bpp] : 0;
+    int up = above ? above[i] : 0;
+    int upLeft = (above && i >= (size_t)bpp) ? above[i - bpp] : 0;
+
+    uint8_t predictor = 0;
+    switch (filter) {
+      case PNG_ROW_FILTER_SUB:   predictor = (uint8_t)left; break;
+      case PNG_ROW_FILTER_UP:    predictor = (uint8_t)up; break;
+      case PNG_ROW_FILTER_AVG:   predictor = (uint8_t)((left + up) >> 1); break;
+      case PNG_ROW_FILTER_PAETH: predictor = png_paeth_predictor(left, up, upLeft); break;
+      default: break;
+    }
+
+    uint8_t filtered = (uint8_t)(row[i] - predictor);
+    out[i + 1] = filtered;
+    sum += abs((int)(int8_t)filtered);
+  }
+  return sum;
+}
+
+// Filters one row into out (1 + stride bytes). Adaptive tries every filter
+// in scratch and keeps the cheapest.
+static void png_filter_row_with(const uint8_t *row, const uint8_t *above, size_t stride,
+                                int filter, uint8_t *out, uint8_t *scratch) {
+  if (filter != PNG_ROW_FILTER_ADAPTIVE) {
+    png_filter_row(row, above, stride, filter, out);
+    return;
+  }
+
+  size_t bestSum = png_filter_row(row, above, stride, PNG_ROW_FILTER_NONE, out);
+  for (int candidate = PNG_ROW_FILTER_SUB; candidate <= PNG_ROW_FILTER_PAETH; candidate++) {
+    size_t sum = png_filter_row(row, above, stride, candidate, scratch);
+    if (sum < bestSum) {
+      bestSum = sum;
+      memcpy(out, scratch, stride + 1);
+    }
+  }
+}
+
+static bool write_raw_png_chunk(FILE *fp, const char *type, const uint8_t *data, size_t length) {
+  uint8_t header[8];
+  header[0] = (uint8_t)(length >> 24);
+  header[1] = (uint8_t)(length >> 16);
+  header[2] = (uint8_t)(length >> 8);
+  header[3] = (uint8_t)length;
+  memcpy(header + 4, type, 4);
+
+  uLong crc = crc32(0L, header + 4, 4);
+  if (length) crc = crc32(crc, data, (uInt)length);
+
+  uint8_t trailer[4] = { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16),
+                         (uint8_t)(crc >> 8), (uint8_t)crc };
+
+  return fwrite(header, 1, 8, fp) == 8 &&
+         (length == 0 || fwrite(data, 1, length, fp) == length) &&
+         fwrite(trailer, 1, 4, fp) == 4;
+}
+
+
+// Writes a packed, row-major RGB buffer out as an 8 bit RGB PNG, deflating
+// bands of rows on separate threads.
+//
+// Every row is filtered first (rows only look at the row above, so this is
+// independent per row). Each band is then deflated as raw deflate data,
+// primed with the 32K of filtered bytes before it as a dictionary so the
+// ratio barely suffers. Every band but the last ends in a sync flush, which
+// byte-aligns it without marking the final block, so the bands concatenate
+// into a single valid zlib stream. Each band goes out as its own IDAT
+// chunk, with the zlib header in front of the first and the combined
+// Adler-32 after the last.
+//
+// Returns false if the file can't be written.
+bool packed_rgb_to_png_parallel(const uint8_t *rgb, int width, int height, const char *filename,
+                                png_encode_options_t options) {
+  size_t stride = 3 * (size_t)width;
+  size_t filteredStride = stride + 1;
+  int level = options.level < 0 ? 0 : (options.level > 9 ? 9 : options.level);
+
+  // Filter every row into one buffer. A thread that can't get its
+  // scratch row skips its rows, and then we give up.
+  uint8_t *filtered = (uint8_t*)malloc(filteredStride * height);
+  if (!filtered) return false;
+  bool filteredAll = true;
+
+  #pragma omp parallel reduction(&&:filteredAll)
+  {
+    uint8_t *scratch = (uint8_t*)malloc(filteredStride);
+    if (!scratch) filteredAll = false;
+
+    #pragma omp for schedule(static)
+    for (int row = 0; row < height; row++) {
+      if (!scratch) continue;
+      const uint8_t *above = (row > 0) ? (rgb + ((row - 1) * stride)) : NULL;
+      png_filter_row_with(rgb + (row * stride), above, stride, options.filter,
+                          filtered + (row * filteredStride), scratch);
+    }
+
+    free(scratch);
+  }
+
+  if (!filteredAll) {
+    free(filtered);
+    return false;
+  }
+
+  // Split the rows into bands of at least 128K of input each so every
+  // band is worth a deflate stream of its own.
+#ifdef _OPENMP
+  int threads = omp_get_max_threads();
+#else
+  int threads = 1;
+#endif
+  int minBandRows = (int)((128 * 1024) / filteredStride) + 1;
+  int bandCount = height / minBandRows;
+  if (bandCount > 4 * threads) bandCount = 4 * threads;
+  if (bandCount < 1) bandCount = 1;
+
+  uint8_t **bandData = (uint8_t**)calloc(bandCount, sizeof(uint8_t*));
+  size_t *bandLength = (size_t*)calloc(bandCount, sizeof(size_t));
+  uLong *bandAdler = (uLong*)calloc(bandCount, sizeof(uLong));
+  size_t *bandInput = (size_t*)calloc(bandCount, sizeof(size_t));
+  bool deflated = true;
+
+  #pragma omp parallel for schedule(dynamic, 1) reduction(&&:deflated)
+  for (int band = 0; band < bandCount; band++) {
+    int rowLow = (int)(((long)height * band) / bandCount);
+    int rowHigh = (int)(((long)height * (band + 1)) / bandCount);
+    const uint8_t *input = filtered + (rowLow * filteredStride);
+    size_t inputLength = (rowHigh - rowLow) * filteredStride;
+    bool lastBand = (band == bandCount - 1);
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    int strategy = (options.filter == PNG_ROW_FILTER_NONE) ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+    if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+      deflated = false;
+      continue;
+    }
+
+    if (band > 0) {
+      size_t before = rowLow * filteredStride;
+      size_t dictionaryLength = before < 32768 ? before : 32768;
+      deflateSetDictionary(&strm, input - dictionaryLength, (uInt)dictionaryLength);
+    }
+
+    // Leave room for the sync flush marker on top of deflate's worst case.
+    size_t capacity = deflateBound(&strm, inputLength) + 16;
+    uint8_t *output = (uint8_t*)malloc(capacity);
+    if (!output) {
+      deflateEnd(&strm);
+      deflated = false;
+      continue;
+    }
+
+    strm.next_in = (Bytef*)input;
+    strm.avail_in = (uInt)inputLength;
+    strm.next_out = output;
+    strm.avail_out = (uInt)capacity;
+    int status = deflate(&strm, lastBand ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((lastBand ? status != Z_STREAM_END : status != Z_OK) || strm.avail_in != 0) {
+      deflated = false;
+    }
+
+    bandData[band] = output;
+    bandLength[band] = capacity - strm.avail_out;
+    bandAdler[band] = adler32(adler32(0L, Z_NULL, 0), input, (uInt)inputLength);
+    bandInput[band] = inputLength;
+    deflateEnd(&strm);
+  }
+
+  FILE *fp = deflated ? fopen(filename, "wb") : NULL;
+  bool ok = (fp != NULL);
+
+  if (ok) {
+    static const uint8_t signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    uint8_t ihdr[13] = {
+      (uint8_t)(width >> 24), (uint8_t)(width >> 16), (uint8_t)(width >> 8), (uint8_t)width,
+      (uint8_t)(height >> 24), (uint8_t)(height >> 16), (uint8_t)(height >> 8), (uint8_t)height,
+      8, PNG_COLOR_TYPE_RGB, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE, PNG_INTERLACE_NONE
+    };
+    ok = fwrite(signature, 1, 8, fp) == 8 && write_raw_png_chunk(fp, "IHDR", ihdr, 13);
+  }
+
+  // The zlib header: 32K window deflate, with the level hint and the check
+  // bits so that the header is a multiple of 31.
+  int levelHint = (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+  uint8_t zlibHeader[2] = { 0x78, (uint8_t)(levelHint << 6) };
+  zlibHeader[1] += 31 - (((zlibHeader[0] << 8) | zlibHeader[1]) % 31);
+
+  uLong adler = adler32(0L, Z_NULL, 0);
+  for (int band = 0; ok && band < bandCount; band++) {
+    adler = adler32_combine(adler, bandAdler[band], (z_off_t)bandInput[band]);
+
+    // Stitch the zlib header and trailer onto the first and last bands.
+    size_t prefix = (band == 0) ? 2 : 0;
+    size_t suffix = (band == bandCount - 1) ? 4 : 0;
+    size_t length = prefix + bandLength[band] + suffix;
+    uint8_t *chunk = (uint8_t*)malloc(length);
+    if (!chunk) {
+      ok = false;
+      break;
+    }
+
+    memcpy(chunk, zlibHeader, prefix);
+    memcpy(chunk + prefix, bandData[band], bandLength[band]);
+    if (suffix) {
+      uint8_t *trailer = chunk + prefix + bandLength[band];
+      trailer[0] = (uint8_t)(adler >> 24);
+      trailer[1] = (uint8_t)(adler >> 16);
+      trailer[2] = (uint8_t)(adler >> 8);
+      trailer[3] = (uint8_t)adler;
+    }
+
+    ok = write_raw_png_chunk(fp, "IDAT", chunk, length);
+    free(chunk);
+  }
+
+  if (ok) ok = write_raw_png_chunk(fp, "IEND", NULL, 0);
+  if (fp) ok = (fclose(fp) == 0) && ok;
+
+  for (int band = 0; band < bandCount; band++) free(bandData[band]);
+  free(bandData);
+  free(bandLength);
+  free(bandAdler);
+  free(bandInput);
+  free(filtered);
+  return ok;
+}
@@ -1,61 +1,119 @@
 //g++ /usr/lib64/libpng.so png_rgb_file_conversion.cpp 
 
 #include "libpng.cpp"
+#include "rawimage.h"
+#include "textimage.h"
+#include <cstring>
 #include <iostream>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sstream>
 
 
+// The zlib level (0-9) and row filter (none, sub, up, avg, paeth or
+// adaptive) that can follow the output name of txt2i and raw2i, like -z
+// and -pngfilter in wireroute. Returns false for an unknown filter.
+static bool png_options_from_args(int argc, const char *argv[], png_encode_options_t *options) {
+  png_encode_options_t defaults = { 6, PNG_ROW_FILTER_ADAPTIVE };
+  *options = defaults;
+  if (argc > 4) options->level = atoi(argv[4]);
+  if (argc > 5) {
+    options->filter = png_filter_from_name(argv[5]);
+    if (options->filter < 0) {
+      printf("Unknown PNG filter: %s\n", argv[5]);
+      return false;
+    }
+  }
+  return true;
+}
+
+
 int main(int argc, const char *argv[])
 {
 
 
   if (!strcmp(argv[1], "i2txt")) {
       // IMAGE TO TXT
-    //char imageName[] = "MyPic.png";
-    image_t inputImage = png_to_rgb((char*)argv[2]);
-
-    int width = inputImage.width;
-    int height = inputImage.height;
+    // Decode straight into packed RGB for the buffered text writer.
+    int width, height;
+    uint8_t *rgb = png_to_packed_rgb(argv[2], &width, &height);
+    if (!rgb) {
+      printf("Unable to read PNG image: %s\n", argv[2]);
+      return -1;
+    }
 
-    // Let's write this data out to a file called image_rgb.txt
-    FILE *outputImageFile = fopen("image_rgb.txt", "w");
-    if (!outputImageFile) return -1;
+    printf("width:%d\n", width);
+    printf("height:%d\n", height);
 
-    fprintf(outputImageFile,"%d %d\n", width, height);
-    for (int i = 0; i < width * height; i++) {
-     fprintf(outputImageFile,"%d %d %d\n", inputImage.r[i], inputImage.g[i], inputImage.b[i]);
-    }
+    // Let's write this data out to a file called image_rgb.txt,
+    // or whatever name was given after the image.
+    const char *outputName = (argc > 3) ? argv[3] : "image_rgb.txt";
+    if (!text_image_write(outputName, rgb, width, height)) return -1;
+    free(rgb);
   } else if (!strcmp(argv[1], "txt2i")) {
-    char imageName[] = "~/outputImage.txt";
-    FILE *inputImageFile = fopen(argv[2], "r");
+    // TXT TO IMAGE
+    // Parse the text file (e.g. ~/outputImage.txt) in parallel and write it
+    // out with the parallel PNG encoder, as output.png or whatever name was
+    // given after the text file, then the PNG options (see
+    // png_options_from_args).
     int width, height;
-    fscanf(inputImageFile, "%d %d\n", &width, &height);
+    uint8_t *rgb = text_image_read(argv[2], &width, &height, NULL);
+    if (!rgb) {
+      printf("Unable to read text image: %s\n", argv[2]);
+      return -1;
+    }
 
     printf("Width: %d Height: %d\n", width, height);
 
-    uint8_t *r = (uint8_t *)calloc(width * height, sizeof(uint8_t));
-    uint8_t *g = (uint8_t *)calloc(width * height, sizeof(uint8_t));
-    uint8_t *b = (uint8_t *)calloc(width * height, sizeof(uint8_t));
-    int rval, gval, bval;
-    int i = 0;
-    while (fscanf(inputImageFile, "%d %d %d\n", &rval, &gval, &bval) != EOF) {
-      r[i] = (uint8_t)rval;
-      g[i] = (uint8_t)gval;
-      b[i] = (uint8_t)bval;
-      i++;
+    const char *outputName = (argc > 3) ? argv[3] : "output.png";
+    png_encode_options_t options;
+    if (!png_options_from_args(argc, argv, &options)) return -1;
+
+    if (!packed_rgb_to_png_parallel(rgb, width, height, outputName, options)) {
+      printf("Error writing PNG image: %s\n", outputName);
+      return -1;
+    }
+    free(rgb);
+  } else if (!strcmp(argv[1], "i2raw")) {
+    // IMAGE TO RAW
+    // Decode straight into packed RGB and write it out as image_rgb.raw,
+    // or whatever name was given after the image.
+    int width, height;
+    uint8_t *rgb = png_to_packed_rgb(argv[2], &width, &height);
+    if (!rgb) {
+      printf("Unable to read PNG image: %s\n", argv[2]);
+      return -1;
+    }
+
+    printf("Width: %d Height: %d\n", width, height);
+    const char *outputName = (argc > 3) ? argv[3] : "image_rgb.raw";
+    if (!raw_image_write(outputName, rgb, width, height)) {
+      printf("Error writing raw image: %s\n", outputName);
+      return -1;
+    }
+    free(rgb);
+  } else if (!strcmp(argv[1], "raw2i")) {
+    // RAW TO IMAGE
+    // Read a raw image (e.g. ~/outputImage.raw) and write it out with the
+    // parallel PNG encoder, the same way txt2i does.
+    int width, height;
+    uint8_t *rgb = raw_image_read(argv[2], &width, &height);
+    if (!rgb) {
+      printf("Unable to read raw image: %s\n", argv[2]);
+      return -1;
     }
 
-    image_t image;
-    image.r = r;
-    image.g = g;
-    image.b = b;
-    image.width = width;
-    image.height = height;
+    printf("Width: %d Height: %d\n", width, height);
+    const char *outputName = (argc > 3) ? argv[3] : "output.png";
+    png_encode_options_t options;
+    if (!png_options_from_args(argc, argv, &options)) return -1;
 
-    rgb_to_image(image);
-  } 
+    if (!packed_rgb_to_png_parallel(rgb, width, height, outputName, options)) {
+      printf("Error writing PNG image: %s\n", outputName);
+      return -1;
+    }
+    free(rgb);
+  }
 
 
   // TXT TO IMAGE
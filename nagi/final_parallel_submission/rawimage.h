@@ -0,0 +1,160 @@
+/**
+ * Binary raw image container
+ * Amolak Nagi and James Mackaman
+ *
+ * A tiny uncompressed image format so the batch nodes don't have to parse
+ * image_rgb.txt before carving. The file is a fixed 24 byte header followed
+ * by height rows of packed RGB bytes, each row stride bytes apart:
+ *
+ *     "SCRI" | width | height | channels | stride | reserved | rows...
+ *
+ * All header fields are native-endian uint32_t (everything we run on is
+ * little-endian). channels is always 3. stride is at least width * 3, and
+ * anything past width * 3 in a row is padding that readers skip.
+ *
+ * Reading maps the file with mmap and copies the rows out, so loading an
+ * image costs about one page-fault pass over the file.
+ */
+
+#ifndef __RAWIMAGE_H__
+#define __RAWIMAGE_H__
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RAW_IMAGE_MAGIC "SCRI"
+#define RAW_IMAGE_CHANNELS 3
+
+typedef struct
+{
+	char magic[4];
+	uint32_t width;
+	uint32_t height;
+	uint32_t channels;
+	uint32_t stride;
+	uint32_t reserved;
+} raw_image_header_t;
+
+
+// Whether a header's dimensions are ones we can carve: both at least 1,
+// and small enough to still be positive as an int.
+static inline bool raw_image_size_valid(const raw_image_header_t *header) {
+    return (header->width > 0) && (header->width <= INT_MAX) &&
+           (header->height > 0) && (header->height <= INT_MAX);
+}
+
+
+// Reads just the dimensions from a raw image file's header.
+// Returns false if the file can't be opened or isn't a raw image.
+static inline bool raw_image_read_size(const char *filename, int *width, int *height) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return false;
+    }
+
+    raw_image_header_t header;
+    bool ok = (fread(&header, sizeof(header), 1, fp) == 1) &&
+              (memcmp(header.magic, RAW_IMAGE_MAGIC, 4) == 0) &&
+              raw_image_size_valid(&header);
+    fclose(fp);
+
+    if (ok) {
+        *width = (int)header.width;
+        *height = (int)header.height;
+    }
+    return ok;
+}
+
+
+// Reads a raw image file into a newly allocated packed RGB buffer
+// (width * 3 bytes per row, no padding). Returns NULL if the file can't
+// be opened or isn't a valid raw image (one with no rows or no columns
+// isn't). The caller frees the buffer.
+static inline uint8_t *raw_image_read(const char *filename, int *width, int *height) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) != 0 || (size_t)fileInfo.st_size < sizeof(raw_image_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t fileSize = (size_t)fileInfo.st_size;
+    void *map = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    // We read the whole file front to back exactly once.
+    madvise(map, fileSize, MADV_SEQUENTIAL);
+
+    const raw_image_header_t *header = (const raw_image_header_t *)map;
+    size_t rowBytes = (size_t)header->width * RAW_IMAGE_CHANNELS;
+    bool valid = (memcmp(header->magic, RAW_IMAGE_MAGIC, 4) == 0) &&
+                 raw_image_size_valid(header) &&
+                 (header->channels == RAW_IMAGE_CHANNELS) &&
+                 (header->stride >= rowBytes) &&
+                 (fileSize - sizeof(raw_image_header_t) >= (size_t)header->stride * header->height);
+    if (!valid) {
+        munmap(map, fileSize);
+        return NULL;
+    }
+
+    uint8_t *rgb = (uint8_t *)malloc(rowBytes * header->height);
+    if (rgb) {
+        const uint8_t *data = (const uint8_t *)map + sizeof(raw_image_header_t);
+
+        // Without padding the pixel data is one contiguous block.
+        if (header->stride == rowBytes) {
+            memcpy(rgb, data, rowBytes * header->height);
+        } else {
+            for (uint32_t row = 0; row < header->height; row++) {
+                memcpy(rgb + (row * rowBytes), data + ((size_t)row * header->stride), rowBytes);
+            }
+        }
+
+        *width = (int)header->width;
+        *height = (int)header->height;
+    }
+
+    munmap(map, fileSize);
+    return rgb;
+}
+
+
+// Writes a packed RGB buffer out as a raw image file with no row padding.
+// Returns false if the file can't be written.
+static inline bool raw_image_write(const char *filename, const uint8_t *rgb, int width, int height) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        return false;
+    }
+
+    raw_image_header_t header;
+    memcpy(header.magic, RAW_IMAGE_MAGIC, 4);
+    header.width = (uint32_t)width;
+    header.height = (uint32_t)height;
+    header.channels = RAW_IMAGE_CHANNELS;
+    header.stride = (uint32_t)width * RAW_IMAGE_CHANNELS;
+    header.reserved = 0;
+
+    size_t dataBytes = (size_t)header.stride * height;
+    bool ok = (fwrite(&header, sizeof(header), 1, fp) == 1) &&
+              (fwrite(rgb, 1, dataBytes, fp) == dataBytes);
+
+    ok = (fclose(fp) == 0) && ok;
+    return ok;
+}
+
+#endif /* __RAWIMAGE_H__ */
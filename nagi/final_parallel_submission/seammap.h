@@ -0,0 +1,119 @@
+/**
+ * Seam map container
+ * Amolak Nagi and James Mackaman
+ *
+ * When we carve an image down to its narrowest width once, we can note for
+ * every pixel which seam took it out. Then any width in between is just the
+ * pixels that are still there after that many seams, with no carving at
+ * all. The file is a fixed 20 byte header followed by height rows of width
+ * native-endian uint16_ts, one per pixel of the original image:
+ *
+ *     "SCSM" | width | height | minWidth | reserved | orders...
+ *
+ * All header fields are native-endian uint32_t. A pixel's order is the
+ * number of seams removed before the one that took it out, so a pixel stays
+ * in the image width - W pixels narrower if its order is at least width - W.
+ * The minWidth pixels a row still has at the end are SEAM_MAP_KEPT, which is
+ * bigger than any seam's order (so width is always under 65535).
+ *
+ * Reading maps the file with mmap and copies the orders out, like
+ * rawimage.h does for pixels.
+ */
+
+#ifndef __SEAMMAP_H__
+#define __SEAMMAP_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SEAM_MAP_MAGIC "SCSM"
+#define SEAM_MAP_KEPT 0xFFFF
+
+typedef struct
+{
+	char magic[4];
+	uint32_t width;
+	uint32_t height;
+	uint32_t minWidth;
+	uint32_t reserved;
+} seam_map_header_t;
+
+
+// Reads a seam map file into a newly allocated width * height array of
+// orders. Returns NULL if the file can't be opened or isn't a valid seam
+// map. The caller frees the array.
+static inline uint16_t *seam_map_read(const char *filename, int *width, int *height, int *minWidth) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) != 0 || (size_t)fileInfo.st_size < sizeof(seam_map_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t fileSize = (size_t)fileInfo.st_size;
+    void *map = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(map, fileSize, MADV_SEQUENTIAL);
+
+    const seam_map_header_t *header = (const seam_map_header_t *)map;
+    size_t count = (size_t)header->width * header->height;
+    bool valid = (memcmp(header->magic, SEAM_MAP_MAGIC, 4) == 0) &&
+                 (header->width < SEAM_MAP_KEPT) &&
+                 (header->minWidth <= header->width) &&
+                 (fileSize - sizeof(seam_map_header_t) >= count * sizeof(uint16_t));
+    if (!valid) {
+        munmap(map, fileSize);
+        return NULL;
+    }
+
+    uint16_t *orders = (uint16_t *)malloc(count * sizeof(uint16_t));
+    if (orders) {
+        memcpy(orders, (const uint8_t *)map + sizeof(seam_map_header_t), count * sizeof(uint16_t));
+        *width = (int)header->width;
+        *height = (int)header->height;
+        *minWidth = (int)header->minWidth;
+    }
+
+    munmap(map, fileSize);
+    return orders;
+}
+
+
+// Writes a width * height array of orders out as a seam map file.
+// Returns false if the file can't be written.
+static inline bool seam_map_write(const char *filename, const uint16_t *orders, int width, int height,
+                                  int minWidth) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        return false;
+    }
+
+    seam_map_header_t header;
+    memcpy(header.magic, SEAM_MAP_MAGIC, 4);
+    header.width = (uint32_t)width;
+    header.height = (uint32_t)height;
+    header.minWidth = (uint32_t)minWidth;
+    header.reserved = 0;
+
+    size_t count = (size_t)width * height;
+    bool ok = (fwrite(&header, sizeof(header), 1, fp) == 1) &&
+              (fwrite(orders, sizeof(uint16_t), count, fp) == count);
+
+    ok = (fclose(fp) == 0) && ok;
+    return ok;
+}
+
+#endif /* __SEAMMAP_H__ */
@@ -0,0 +1,317 @@
+/**
+ * Fast image_rgb.txt parsing
+ * Amolak Nagi and James Mackaman
+ *
+ * The text format is "width height" on the first line followed by one
+ * "r g b" line per pixel. Parsing it with fscanf is single threaded and
+ * was the biggest part of our startup time, so this reads the whole file
+ * in one go and parses it in parallel.
+ *
+ * The file is split into one chunk per thread at newline boundaries. Each
+ * thread first counts the numbers in its chunk, a prefix sum over those
+ * counts gives every chunk its starting offset, and then every thread
+ * parses its numbers straight into the output buffer. Numbers are placed by
+ * their position in the file rather than by line, so any whitespace layout
+ * fscanf("%d %d %d\n") accepts gives exactly the same bytes.
+ *
+ * Writing goes the other way: blocks of rows are formatted in parallel into
+ * one reusable buffer using a lookup table for the numbers, and each filled
+ * buffer goes out in a handful of large fwrite calls. The output is byte for
+ * byte what the old fprintf("%d %d %d\n") loop wrote.
+ */
+
+#ifndef __TEXTIMAGE_H__
+#define __TEXTIMAGE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define TEXT_IMAGE_CHANNELS 3
+
+// The longest line we write is "255 255 255\n".
+#define TEXT_IMAGE_MAX_LINE 12
+
+// How many bytes of text each thread formats before we write them out.
+#define TEXT_IMAGE_BLOCK_BYTES (1 << 20)
+
+
+// Same characters isspace() accepts: ' ', \t, \n, \v, \f and \r.
+static inline bool text_is_space(char c) {
+    return (c == ' ') || ((unsigned)(c - '\t') < 5);
+}
+
+
+// Parses one decimal integer at text the way %d does, skipping leading
+// whitespace first. The buffer must end with a non-digit sentinel.
+// Returns the position just past the number.
+static inline const char *text_parse_int(const char *text, int *value) {
+    while (text_is_space(*text)) {
+        text++;
+    }
+
+    bool negative = (*text == '-');
+    text += (negative || (*text == '+'));
+
+    int parsed = 0;
+    unsigned digit;
+    while ((digit = (unsigned)(*text - '0')) < 10) {
+        parsed = (parsed * 10) + (int)digit;
+        text++;
+    }
+
+    *value = negative ? -parsed : parsed;
+    return text;
+}
+
+
+// Counts the whitespace-separated numbers in [begin, end).
+static inline size_t text_count_values(const char *begin, const char *end) {
+    size_t count = 0;
+    bool inValue = false;
+    for (const char *c = begin; c < end; c++) {
+        bool isValue = !text_is_space(*c);
+        count += (isValue && !inValue);
+        inValue = isValue;
+    }
+    return count;
+}
+
+
+// Reads an image_rgb.txt file into a newly allocated packed RGB buffer
+// (3 bytes per pixel). Missing pixels are left as 0 and extra ones are
+// ignored. If fileBytes isn't NULL, it's set to the size of the file.
+// Returns NULL if the file can't be read. The caller frees the buffer.
+static inline uint8_t *text_image_read(const char *filename, int *width, int *height, size_t *fileBytes) {
+    FILE *input = fopen(filename, "rb");
+    if (!input) {
+        return NULL;
+    }
+
+    // Pull the whole file in at once, with a '\0' sentinel on the end
+    // so the number parser never has to check for the end of the buffer.
+    fseek(input, 0, SEEK_END);
+    long size = ftell(input);
+    fseek(input, 0, SEEK_SET);
+    if (size < 0) {
+        fclose(input);
+        return NULL;
+    }
+
+    char *text = (char *)malloc((size_t)size + 1);
+    size_t length = text ? fread(text, 1, (size_t)size, input) : 0;
+    fclose(input);
+    if (!text) {
+        return NULL;
+    }
+    text[length] = '\0';
+
+    // The first line of the image will be the dimensions.
+    const char *body = text_parse_int(text, width);
+    body = text_parse_int(body, height);
+    if ((*width <= 0) || (*height <= 0)) {
+        free(text);
+        return NULL;
+    }
+
+    size_t valueCount = (size_t)(*width) * (*height) * TEXT_IMAGE_CHANNELS;
+    uint8_t *rgb = (uint8_t *)calloc(valueCount, sizeof(uint8_t));
+    if (!rgb) {
+        free(text);
+        return NULL;
+    }
+
+    const char *end = text + length;
+
+#ifdef _OPENMP
+    int chunkCount = omp_get_max_threads();
+#else
+    int chunkCount = 1;
+#endif
+
+    // Split the body into evenly sized chunks, moving each split point
+    // forward to just past the next newline so no number is cut in half.
+    const char **chunkStart = (const char **)malloc((chunkCount + 1) * sizeof(const char *));
+    size_t *chunkOffset = (size_t *)malloc((chunkCount + 1) * sizeof(size_t));
+    size_t bodyLength = (size_t)(end - body);
+    chunkStart[0] = body;
+    for (int chunk = 1; chunk < chunkCount; chunk++) {
+        const char *split = body + ((bodyLength * chunk) / chunkCount);
+        if (split < chunkStart[chunk - 1]) {
+            split = chunkStart[chunk - 1];
+        }
+        const char *newline = (const char *)memchr(split, '\n', (size_t)(end - split));
+        chunkStart[chunk] = newline ? (newline + 1) : end;
+    }
+    chunkStart[chunkCount] = end;
+
+    // Count the values in each chunk, then prefix sum the counts to find
+    // where each chunk's first value lands in the image.
+    #pragma omp parallel for schedule(static, 1)
+    for (int chunk = 0; chunk < chunkCount; chunk++) {
+        chunkOffset[chunk + 1] = text_count_values(chunkStart[chunk], chunkStart[chunk + 1]);
+    }
+    chunkOffset[0] = 0;
+    for (int chunk = 0; chunk < chunkCount; chunk++) {
+        chunkOffset[chunk + 1] += chunkOffset[chunk];
+    }
+
+    // Parse every chunk straight into its place in the image.
+    #pragma omp parallel for schedule(static, 1)
+    for (int chunk = 0; chunk < chunkCount; chunk++) {
+        const char *c = chunkStart[chunk];
+        const char *chunkEnd = chunkStart[chunk + 1];
+        size_t value = chunkOffset[chunk];
+
+        while (value < valueCount) {
+            while ((c < chunkEnd) && text_is_space(*c)) {
+                c++;
+            }
+            if (c >= chunkEnd) {
+                break;
+            }
+
+            // Stop on anything that isn't a number rather than spin on it.
+            int parsed;
+            const char *next = text_parse_int(c, &parsed);
+            if (next == c) {
+                break;
+            }
+            c = next;
+            rgb[value++] = (uint8_t)parsed;
+        }
+    }
+
+    free(chunkStart);
+    free(chunkOffset);
+    free(text);
+
+    if (fileBytes) {
+        *fileBytes = length;
+    }
+    return rgb;
+}
+
+
+// Decimal text for every byte value, padded to 4 bytes so it can be
+// copied with a single fixed-size memcpy.
+typedef struct
+{
+	char text[4];
+	int length;
+} text_byte_t;
+
+// Built once on first use. Static local initialization is thread safe, so
+// concurrent writers can share it.
+struct text_byte_table_t
+{
+	text_byte_t entry[256];
+
+	text_byte_table_t() {
+		for (int value = 0; value < 256; value++) {
+			entry[value].length = snprintf(entry[value].text, 4, "%d", value);
+		}
+	}
+};
+
+static inline const text_byte_t *text_byte_table() {
+    static const text_byte_table_t table;
+    return table.entry;
+}
+
+
+// Formats rows [rowLow, rowHigh) of a packed RGB image into out, one
+// "r g b" line per pixel. out needs TEXT_IMAGE_MAX_LINE bytes per pixel
+// plus 4 bytes of slack. Returns the number of bytes written.
+static inline size_t text_format_rows(const uint8_t *rgb, int width, int rowLow, int rowHigh,
+                                      const text_byte_t *table, char *out) {
+    char *c = out;
+    const uint8_t *value = rgb + ((size_t)rowLow * width * TEXT_IMAGE_CHANNELS);
+    const uint8_t *end = rgb + ((size_t)rowHigh * width * TEXT_IMAGE_CHANNELS);
+
+    for (; value < end; value += TEXT_IMAGE_CHANNELS) {
+        const text_byte_t &r = table[value[0]];
+        const text_byte_t &g = table[value[1]];
+        const text_byte_t &b = table[value[2]];
+
+        memcpy(c, r.text, 4);
+        c += r.length;
+        *c++ = ' ';
+        memcpy(c, g.text, 4);
+        c += g.length;
+        *c++ = ' ';
+        memcpy(c, b.text, 4);
+        c += b.length;
+        *c++ = '\n';
+    }
+
+    return (size_t)(c - out);
+}
+
+
+// Writes a packed RGB buffer out in the image_rgb.txt format. Returns
+// false if the file can't be written.
+static inline bool text_image_write(const char *filename, const uint8_t *rgb, int width, int height) {
+    FILE *output = fopen(filename, "wb");
+    if (!output) {
+        return false;
+    }
+
+    bool ok = fprintf(output, "%d %d\n", width, height) > 0;
+
+#ifdef _OPENMP
+    int blockCount = omp_get_max_threads();
+#else
+    int blockCount = 1;
+#endif
+
+    // Each thread formats a block of whole rows into its own slice of
+    // the buffer. A group of blocks is written out before the buffer is
+    // reused for the next group.
+    size_t rowBytes = (size_t)width * TEXT_IMAGE_MAX_LINE;
+    int blockRows = (int)(TEXT_IMAGE_BLOCK_BYTES / rowBytes);
+    if (blockRows < 1) {
+        blockRows = 1;
+    }
+    if (blockRows > height) {
+        blockRows = height;
+    }
+    size_t blockCapacity = (blockRows * rowBytes) + 4;
+
+    char *buffer = (char *)malloc(blockCount * blockCapacity);
+    size_t *blockLength = (size_t *)malloc(blockCount * sizeof(size_t));
+    if (!buffer || !blockLength) {
+        ok = false;
+    }
+
+    const text_byte_t *table = text_byte_table();
+
+    for (int groupRow = 0; ok && (groupRow < height); groupRow += blockCount * blockRows) {
+
+        #pragma omp parallel for schedule(static, 1)
+        for (int block = 0; block < blockCount; block++) {
+            int rowLow = groupRow + (block * blockRows);
+            int rowHigh = std::min(rowLow + blockRows, height);
+            blockLength[block] = (rowLow < rowHigh)
+                ? text_format_rows(rgb, width, rowLow, rowHigh, table, buffer + (block * blockCapacity))
+                : 0;
+        }
+
+        for (int block = 0; ok && (block < blockCount); block++) {
+            ok = fwrite(buffer + (block * blockCapacity), 1, blockLength[block], output) == blockLength[block];
+        }
+    }
+
+    free(buffer);
+    free(blockLength);
+
+    ok = (fclose(output) == 0) && ok;
+    return ok;
+}
+
+#endif /* __TEXTIMAGE_H__ */
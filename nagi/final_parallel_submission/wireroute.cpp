@@ -12,6 +12,12 @@
  *
  * Information regarding how to run this code is available in the README.
  *
+ * When built with USE_LIBPNG (make cpu), PNG files can be given to -f
+ * directly and the result is written straight back out as a PNG. The
+ * Xeon Phi build leaves libpng out and only understands image_rgb.txt.
+ * Either build also reads and writes the binary .raw format in rawimage.h,
+ * which skips text parsing altogether.
+ *
  * If you would like to change the number of seams to remove from the
  * provided image, you can set the #define SEAM_COUNT below
  */
@@ -22,18 +28,42 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <strings.h>
 #include <assert.h>
 #include <algorithm>
 #include <cfloat>
+#include <limits>
 #include <omp.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
 #include "mic.h"
+#include "rawimage.h"
+#include "seammap.h"
+#include "textimage.h"
+#include "energy_simd.h"
+#include "acm_simd.h"
+#include "acm_parents.h"
+
+#ifdef USE_LIBPNG
+#include "libpng.cpp"
+#endif
 
 #define INDEX(row, col, width)  ((width * (row)) + (col))
 
 // You can set this variable to be however many seams you'd like
-// to remove from your algorithm.
+// to remove from your algorithm. It can also be set with -s.
 #define SEAM_COUNT 960
 
+// In batch mode, how many pixels an image needs per thread before it's
+// worth giving it more than one thread of its own.
+#define BATCH_PIXELS_PER_THREAD (1 << 18)
+
 // Simple data structure to contain a pixel in our image.
 typedef struct {
     uint8_t r;
@@ -41,13 +71,70 @@ typedef struct {
     uint8_t b;
 } pixel;
 
+// Image buffers are handed to and from libpng as packed RGB bytes.
+static_assert(sizeof(pixel) == 3, "pixel must be 3 packed bytes");
+
+// While we carve, the pixels, energy and ACM keep the row pitch they
+// started with, so taking a seam out only moves the rest of each row
+// within the row. Pitches are rounded up to ROW_ALIGN entries and the
+// buffers start on a cache line, so every row does too: 64 entries is a
+// whole number of CACHE_LINE byte lines for 3 byte pixels as well as for
+// 2, 4 and 8 byte values.
+#define CACHE_LINE 64
+#define ROW_ALIGN 64
+
+inline int rowPitch(int width) {
+    return ((width + ROW_ALIGN - 1) / ROW_ALIGN) * ROW_ALIGN;
+}
+
+// Allocates a buffer starting on a cache line, or returns NULL. It's freed
+// with free like any other.
+inline void *allocRows(size_t bytes) {
+    void *rows = NULL;
+    if (posix_memalign(&rows, CACHE_LINE, bytes) != 0) {
+        return NULL;
+    }
+    return rows;
+}
+
+// Energy comes in three flavors. By default it's a double in [0, 1], the
+// gradient divided by the largest gradient the energy function can give,
+// and the ACM is a double too. The float pipeline (-float) is the same in
+// floats, half the size. The integer pipeline (-int) keeps the raw
+// gradient as a uint16_t and accumulates it in a uint32_t ACM, which is a
+// quarter and a half the size. They all put pixels and paths in the same
+// order (up to rounding) since one is just the other scaled by maxDelta.
+template <typename energy_t> inline energy_t energyFromDelta(int delta, int maxDelta);
+
+template <> inline double energyFromDelta<double>(int delta, int maxDelta) {
+    return (((double)delta) / ((double)maxDelta));
+}
+
+template <> inline float energyFromDelta<float>(int delta, int maxDelta) {
+    return (((float)delta) / ((float)maxDelta));
+}
+
+template <> inline uint16_t energyFromDelta<uint16_t>(int delta, int maxDelta) {
+    return (uint16_t)delta;
+}
+
+template <> inline uint32_t energyFromDelta<uint32_t>(int delta, int maxDelta) {
+    return (uint32_t)delta;
+}
+
+// Cost of a path we should never take in the ACM.
+template <typename cost_t> inline cost_t maxCost() {
+    return std::numeric_limits<cost_t>::max();
+}
+
 
 
 
-// Simple helper function to find the minimum of 3 doubles
-// Helpful for our ACM generation.
-double min(double d1, double d2, double d3) {
-     double max = d3;
+// Simple helper function to find the minimum of 3 costs (doubles, or
+// integers in the integer pipeline). Helpful for our ACM generation.
+template <typename cost_t>
+cost_t min(cost_t d1, cost_t d2, cost_t d3) {
+     cost_t max = d3;
      if (d2 < max) {
           max = d2;
      }
@@ -61,6 +148,11 @@ double min(double d1, double d2, double d3) {
 static int _argc;
 static const char **_argv;
 
+#ifdef USE_LIBPNG
+// How PNG output gets encoded, set from -z and -pngfilter in main.
+static png_encode_options_t pngOptions = { 6, PNG_ROW_FILTER_ADAPTIVE };
+#endif
+
 
 const char *get_option_string(const char *option_name,
 			      const char *default_value)
@@ -82,46 +174,187 @@ int get_option_int(const char *option_name, int default_value)
 
 
 
-// Helper function to calculate the energy of each pixel in a
-// provided image. Takes in an array of pixels for which to calculate the
-// image and writes the output to the provided energy array
-// with corresponding indices.
-void calculateEnergy(pixel *pixels, double *energy, int width, int height) {
+// Which energy kernel (scalar, SSE4.1 or AVX2) does the inner loop of
+// HorizontalEnergy. main picks the best one the CPU has, or the one
+// -energykernel asks for.
+static energy_kernel_t energyKernel = energyDeltasScalar;
 
-     #pragma omp parallel for
-     for (int row = 0; row < height; row++) {
-        for (int col = 0; col < width; col++) {
 
-            // For simplicity, make all edges 1
-            if ((row == 0) || 
-                (row == (height - 1)) ||
-                (col == 0) || 
-                (col == (width - 1))) {
-                    energy[INDEX(row,col,width)] = 1;
-                    continue;                    
-            }
+// Sums the channel gradients between pixels a[col] and b[col] for columns
+// 1 to width - 2, using the energy kernel.
+inline void pixelDeltas(const pixel *a, const pixel *b, uint16_t *delta, int width) {
+#ifdef ENERGY_SIMD
+    energyKernel((const uint8_t *)a, (const uint8_t *)b, delta, width);
+#else
+    energyDeltasScalar((const uint8_t *)a, (const uint8_t *)b, delta, width);
+#endif
+}
+
+
+// The energy functions we can carve with, picked with -energy. Each one is
+// a policy class the energy and carving functions are templated on, so its
+// gradient gets inlined into their loops. A policy gives:
+//
+//   maxDelta              the largest gradient it can return, which is
+//                         also the energy of every edge pixel
+//   delta(pixels, ...)    the gradient of an interior pixel, with the
+//                         image's rows pitch pixels apart
+//   deltasForRow(...)     delta for columns 1 to width - 2 of an interior row
+//
+// All of them only look at the pixels directly around the one they're
+// computing, so recomputing the energy around a removed seam still works.
+enum EnergyFunction { energyHorizontal, energyDualGradient, energySobel, energyLuma, energyFunctionCount };
+
+static const char *energyFunctionNames[energyFunctionCount] = { "horizontal", "dual", "sobel", "luma" };
+
+
+// Sums the gradient of the channels between two pixels.
+inline int channelDelta(const pixel &a, const pixel &b) {
+    return abs(a.r - b.r) + abs(a.g - b.g) + abs(a.b - b.b);
+}
+
+
+// The generic row loop, for policies without a faster one.
+template <typename energy_policy_t>
+inline void deltasForRowByPixel(const pixel *pixels, int row, int width, int pitch, uint16_t *delta) {
+    for (int col = 1; col < (width - 1); col++) {
+        delta[col] = (uint16_t)energy_policy_t::delta(pixels, row, col, pitch);
+    }
+}
+
+
+// Horizontal gradient only, |left - right| over each channel. This is what
+// we've always carved with, and the default.
+struct HorizontalEnergy
+{
+    // 3 * (255)
+    static const int maxDelta = 765;
+
+    static inline int delta(const pixel *pixels, int row, int col, int pitch) {
+        return channelDelta(pixels[INDEX(row, col+1, pitch)], pixels[INDEX(row, col-1, pitch)]);
+    }
+
+    static inline void deltasForRow(const pixel *pixels, int row, int width, int pitch, uint16_t *delta) {
+        const pixel *here = pixels + INDEX(row, 0, pitch);
+        pixelDeltas(here + 1, here - 1, delta, width);
+    }
+};
+
+
+// Horizontal plus vertical gradient over each channel. This is the energy
+// the CUDA and sequential versions (pll_energy, pll_acm and seq) use.
+struct DualGradientEnergy
+{
+    // 3 * (255 + 255)
+    static const int maxDelta = 1530;
+
+    static inline int delta(const pixel *pixels, int row, int col, int pitch) {
+        return channelDelta(pixels[INDEX(row, col+1, pitch)], pixels[INDEX(row, col-1, pitch)]) +
+               channelDelta(pixels[INDEX(row+1, col, pitch)], pixels[INDEX(row-1, col, pitch)]);
+    }
+
+    static inline void deltasForRow(const pixel *pixels, int row, int width, int pitch, uint16_t *delta) {
+        deltasForRowByPixel<DualGradientEnergy>(pixels, row, width, pitch, delta);
+    }
+};
+
+
+// 3x3 Sobel operator on each channel, |Gx| + |Gy| summed over the channels.
+// Less sensitive to noise than the plain gradients.
+struct SobelEnergy
+{
+    // 3 * (4 * 255 + 4 * 255)
+    static const int maxDelta = 6120;
+
+    static inline int channelSobel(int upLeft, int up, int upRight,
+                                   int left, int right,
+                                   int downLeft, int down, int downRight) {
+        int gx = (upRight + (2 * right) + downRight) - (upLeft + (2 * left) + downLeft);
+        int gy = (downLeft + (2 * down) + downRight) - (upLeft + (2 * up) + upRight);
+        return abs(gx) + abs(gy);
+    }
 
-           // Determine the dx for each color channel
-           int rLeft = pixels[INDEX(row, col-1, width)].r;
-           int gLeft = pixels[INDEX(row, col-1, width)].g;
-           int bLeft = pixels[INDEX(row, col-1, width)].b;
+    static inline int delta(const pixel *pixels, int row, int col, int pitch) {
+        const pixel *above = pixels + INDEX(row-1, col, pitch);
+        const pixel *here = pixels + INDEX(row, col, pitch);
+        const pixel *below = pixels + INDEX(row+1, col, pitch);
+
+        return channelSobel(above[-1].r, above[0].r, above[1].r, here[-1].r, here[1].r,
+                            below[-1].r, below[0].r, below[1].r) +
+               channelSobel(above[-1].g, above[0].g, above[1].g, here[-1].g, here[1].g,
+                            below[-1].g, below[0].g, below[1].g) +
+               channelSobel(above[-1].b, above[0].b, above[1].b, here[-1].b, here[1].b,
+                            below[-1].b, below[0].b, below[1].b);
+    }
+
+    static inline void deltasForRow(const pixel *pixels, int row, int width, int pitch, uint16_t *delta) {
+        deltasForRowByPixel<SobelEnergy>(pixels, row, width, pitch, delta);
+    }
+};
+
+
+// Horizontal plus vertical gradient of the pixels' brightness (BT.601
+// luma) rather than of each channel, closer to what the eye notices.
+struct LumaEnergy
+{
+    // 255 + 255
+    static const int maxDelta = 510;
+
+    static inline int luma(const pixel &p) {
+        return ((77 * p.r) + (150 * p.g) + (29 * p.b) + 128) >> 8;
+    }
 
-           int rRight = pixels[INDEX(row, col+1, width)].r;
-           int gRight = pixels[INDEX(row, col+1, width)].g;
-           int bRight = pixels[INDEX(row, col+1, width)].b;
+    static inline int delta(const pixel *pixels, int row, int col, int pitch) {
+        return abs(luma(pixels[INDEX(row, col+1, pitch)]) - luma(pixels[INDEX(row, col-1, pitch)])) +
+               abs(luma(pixels[INDEX(row+1, col, pitch)]) - luma(pixels[INDEX(row-1, col, pitch)]));
+    }
+
+    static inline void deltasForRow(const pixel *pixels, int row, int width, int pitch, uint16_t *delta) {
+        deltasForRowByPixel<LumaEnergy>(pixels, row, width, pitch, delta);
+    }
+};
 
-           int rdx = abs(rRight - rLeft);
-           int gdx = abs(gRight - gLeft);
-           int bdx = abs(bRight - bLeft);
 
-           // The maximum delta is 3 * (255)
-           // which is 765
-           int delta = rdx + gdx + bdx;
+// Helper function to calculate the energy of every pixel in one row of a
+// provided image. Only needs the row itself and the rows directly above
+// and below it, so it can run as soon as those have been read in. The rows
+// of both the pixels and the energy are pitch apart.
+template <typename energy_policy_t, typename energy_t>
+void calculateEnergyForRow(pixel *pixels, energy_t *energy, int row, int width, int height, int pitch) {
+    const int maxDelta = energy_policy_t::maxDelta;
+    energy_t *energyRow = energy + INDEX(row, 0, pitch);
 
-           // Compute and set our energy value.
-           double energyValue = (((double)delta) / ((double)765));
-           energy[INDEX(row, col, width)] = energyValue;
+    // For simplicity, make all edges 1
+    if ((row == 0) || (row == (height - 1))) {
+        for (int col = 0; col < width; col++) {
+            energyRow[col] = energyFromDelta<energy_t>(maxDelta, maxDelta);
         }
+        return;
+    }
+
+    // Every maxDelta fits in 16 bits.
+    uint16_t delta[width];
+    energy_policy_t::deltasForRow(pixels, row, width, pitch, delta);
+
+    // Compute and set our energy values.
+    energyRow[0] = energyFromDelta<energy_t>(maxDelta, maxDelta);
+    for (int col = 1; col < (width - 1); col++) {
+        energyRow[col] = energyFromDelta<energy_t>(delta[col], maxDelta);
+    }
+    energyRow[width - 1] = energyFromDelta<energy_t>(maxDelta, maxDelta);
+}
+
+
+// Helper function to calculate the energy of each pixel in a
+// provided image. Takes in an array of pixels for which to calculate the
+// image and writes the output to the provided energy array
+// with corresponding indices, rows pitch apart in both.
+template <typename energy_policy_t, typename energy_t>
+void calculateEnergy(pixel *pixels, energy_t *energy, int width, int height, int pitch) {
+
+     #pragma omp parallel for schedule(static)
+     for (int row = 0; row < height; row++) {
+        calculateEnergyForRow<energy_policy_t>(pixels, energy, row, width, height, pitch);
     }
 }
 
@@ -131,14 +364,17 @@ void calculateEnergy(pixel *pixels, double *energy, int width, int height) {
 // provided image. Takes in an array of pixels for which to calculate the
 // image and writes the output to the provided energy array
 // with corresponding indices. Also takes in the seam along  which to compute energies
-void calculateEnergyAlongSeam(pixel *pixels, double *energy, int *seam, int width, int height) {
+template <typename energy_policy_t, typename energy_t>
+void calculateEnergyAlongSeam(pixel *pixels, energy_t *energy, int *seam, int width, int height, int pitch) {
+    const int maxDelta = energy_policy_t::maxDelta;
 
     #pragma omp parallel for
     for (int row = 0; row < height; row++) {
         int colRemoved = seam[row];
 
-        // We choose to recompute the 5 energies around
-        // the column of the seam in this row
+        // We choose to recompute the 5 energies around the column of the
+        // seam in this row. Seams only move one column per row, so this
+        // also covers every pixel whose neighbors above or below shifted.
         int lowerBound = colRemoved - 2;
         int upperBound = colRemoved + 2;
         for (int col = lowerBound; col <= upperBound; col++) {
@@ -156,418 +392,3540 @@ void calculateEnergyAlongSeam(pixel *pixels, double *energy, int *seam, int widt
                 (row == (height - 1)) ||
                 (col == 0) || 
                 (col == (width - 1))) {
-                    energy[INDEX(row,col,width)] = 1;
+                    energy[INDEX(row,col,pitch)] = energyFromDelta<energy_t>(maxDelta, maxDelta);
                     continue;                    
             }
 
-            // Calculate the dx around this pixel for each channel
-            int rLeft = pixels[INDEX(row, col-1, width)].r;
-            int gLeft = pixels[INDEX(row, col-1, width)].g;
-            int bLeft = pixels[INDEX(row, col-1, width)].b; 
+            // Compute and set our energy value.
+            int delta = energy_policy_t::delta(pixels, row, col, pitch);
+            energy[INDEX(row, col, pitch)] = energyFromDelta<energy_t>(delta, maxDelta);
+
+        }
+    }
+}
 
-            int rRight = pixels[INDEX(row, col+1, width)].r;
-            int gRight = pixels[INDEX(row, col+1, width)].g;
-            int bRight = pixels[INDEX(row, col+1, width)].b;
 
-            int rdx = abs(rRight - rLeft);
-            int gdx = abs(gRight - gLeft);
-            int bdx = abs(bRight - bLeft);
 
-            // The maximum delta is 3 * (255)
-            // which is 765
-            int delta = rdx + gdx + bdx;
 
-            // Compute and set our energy value.
-            double energyValue = (((double)delta) / ((double)765));
-            energy[INDEX(row, col, width)] = energyValue;
 
-        }
+// Which ACM row kernel (scalar, AVX2 or AVX-512) calculateACMSpan uses.
+// main picks the best one the CPU has, or the one -acmkernel asks for.
+static int acmKernel = acmKernelScalar;
+
+
+// The ACM functions take the ACM as an array of row pointers, one per row
+// of the image. For a whole ACM they point at consecutive rows pitch apart
+// (see pointACMRows), but rows nobody reads afterwards can share scratch
+// buffers instead (see rollACMRows and sweepACMBands).
+template <typename cost_t>
+void pointACMRows(cost_t **acm, cost_t *matrix, int height, int pitch) {
+    for (int row = 0; row < height; row++) {
+        acm[row] = matrix + INDEX(row, 0, pitch);
     }
 }
 
 
+// Fills the edge columns of an ACM with a sentinel cost. Seams never step
+// onto the edges, so with the largest cost there the ACM sweep can treat
+// every column the same.
+template <typename cost_t>
+void setACMEdgeColumns(cost_t **acm, int width, int height, cost_t value) {
+    for (int row = 0; row < height; row++) {
+        acm[row][0] = value;
+        acm[row][width - 1] = value;
+    }
+}
 
 
+// Computes columns [colLow, colHigh) of one row of the ACM (accumulated
+// cost matrix) from the row above it, which needs sentinel edge columns,
+// and notes each entry's parent if parents isn't NULL (-backtrack
+// parents). Every entry only depends on the three above it, so any split
+// of a row into spans gives exactly the same result.
+template <typename cost_t>
+inline void calculateACMSpan(cost_t **acm, acm_parents_t *parents, int row, int colLow, int colHigh) {
+    if (!parents) {
+#ifdef ACM_SIMD
+        acmKernelFunction<cost_t>(acmKernel)(acm[row-1], acm[row], colLow, colHigh);
+#else
+        acmRowScalar(acm[row-1], acm[row], colLow, colHigh);
+#endif
+        return;
+    }
+    if (colHigh <= colLow) {
+        return;
+    }
 
-// Given a region of pixels, calculate the ACM (accumulated cost matrix)
-// for that region. This is used as a helper to be called by each thread for
-// our spatial decomposition.
-// low is inclusive, high is exclusive.
-void calculateACMForRegion(double *acm, int width, int height, int rowLow, int rowHigh) {
+    uint8_t directions[colHigh - colLow];
+#ifdef ACM_SIMD
+    acmParentKernelFunction<cost_t>(acmKernel)(acm[row-1], acm[row], directions, colLow, colHigh);
+#else
+    acmRowParentsScalar(acm[row-1], acm[row], directions, colLow, colHigh);
+#endif
+    acm_parents_store(parents, row, colLow, colHigh, directions);
+}
 
-    // Iterate through our region of rows
-    for (int row = rowLow; row < rowHigh; row++) {
 
-        // As a cache optimization, read all the values in the above row FIRST
-        double rowAbove[width];
-        rowAbove[0] = DBL_MAX;
-        for (int col = 1; col < (width - 1); col++) {
-            rowAbove[col] = acm[INDEX(row-1, col, width)];
+// An energy matrix with its rows pitch entries apart, which is what the
+// ACM is computed from. A carve's (see carveImageWith) keeps its pitch
+// however narrow the image gets, and a plain matrix's pitch is its width.
+// If seams are taken out of it lazily, index isn't NULL, and each of its
+// rows (also pitch apart) lists which of that row's entries are still in
+// the image, in order.
+template <typename energy_t>
+struct pitched_energy_t
+{
+	const energy_t *values;
+	const uint16_t *index;
+	int pitch;
+};
+
+
+// Copies columns [colLow, colHigh) of one row of an energy matrix into a
+// row of the ACM, gathered through the index if it's lazy.
+template <typename energy_t, typename cost_t>
+inline void loadEnergySpan(const pitched_energy_t<energy_t> &energy, int row, int colLow, int colHigh,
+                           cost_t *acmRow) {
+    const energy_t *energyRow = energy.values + INDEX(row, 0, energy.pitch);
+    if (!energy.index) {
+        for (int col = colLow; col < colHigh; col++) {
+            acmRow[col] = (cost_t)energyRow[col];
         }
-        rowAbove[(width-1)] = DBL_MAX;
-
-        // Once we have our row above, perform the acm calculation
-        // for this row. Disregard the edges of the image when looking
-        // at columns.
-        for (int col = 1; col < (width - 1); col++) {
+        return;
+    }
+    const uint16_t *indexRow = energy.index + INDEX(row, 0, energy.pitch);
+    for (int col = colLow; col < colHigh; col++) {
+        acmRow[col] = (cost_t)energyRow[indexRow[col]];
+    }
+}
 
-            double upLeft = rowAbove[col-1];
-            double up = rowAbove[col];
-            double upRight = rowAbove[col+1];
 
-            acm[INDEX(row, col, width)] = acm[INDEX(row, col, width)] + min(upLeft, up, upRight);
+// One span of the ACM straight from the energy: copies it in and adds on
+// the cheapest path above. Rows 0 and 1 keep their energy (we've always
+// started accumulating at row 2), but row 1 still gets parents, so a seam
+// can be traced up into row 0.
+template <typename energy_t, typename cost_t>
+inline void calculateACMSpanFromEnergy(const pitched_energy_t<energy_t> &energy, cost_t **acm,
+                                       acm_parents_t *parents, int row, int colLow, int colHigh) {
+    loadEnergySpan(energy, row, colLow, colHigh, acm[row]);
+    if (row >= 2) {
+        calculateACMSpan(acm, parents, row, colLow, colHigh);
+    } else if ((row == 1) && parents && (colHigh > colLow)) {
+        uint8_t directions[colHigh - colLow];
+        const cost_t *above = acm[0];
+        for (int col = colLow; col < colHigh; col++) {
+            directions[col - colLow] = acmParentDirection(above[col-1], above[col], above[col+1]);
         }
+        acm_parents_store(parents, row, colLow, colHigh, directions);
+    }
+}
+
+
+// How many rows each tile of the parallel ACM sweep covers, at most.
+#define ACM_TILE_ROWS 32
+
+// How many rows apart the sweep can be working at once, over all threads.
+// A ring of this many rows is enough to hold every row still being read
+// (see rollACMRows).
+#define ACM_RING_ROWS ((2 * ACM_TILE_ROWS) + 2)
+
+// How many blocks of rows a tile of the ACM sweep has finished, one per
+// thread, padded so neighbors don't share a cache line.
+typedef struct
+{
+	std::atomic<int> blocks;
+	char padding[64 - sizeof(std::atomic<int>)];
+} acm_ready_flag_t;
+
+
+// Waits until flag says at least blocks blocks are done.
+inline void waitForACMFlag(acm_ready_flag_t *flag, int blocks) {
+    while (flag->blocks.load(std::memory_order_acquire) < blocks) {
+        std::this_thread::yield();
     }
 }
 
 
-// Perform the ACM generation step of our algorithm. This is parallelized
-// into tasks by OpenMP
-void calculateACM(double *acm, int width, int height) {
-    
-    // Get our number of threads as well as the height of
-    // each vertical region, called separationPoint.
+// Runs span(row, colLow, colHigh) over rows [firstRow, height) and the
+// interior columns of an ACM in parallel, always computing a row's span
+// after the spans above it that it reads. The result is exactly what one
+// thread sweeping the rows top to bottom would get.
+//
+// The interior columns are split into one strip per thread, and the rows
+// into blocks of up to ACM_TILE_ROWS. Within a block, each thread first
+// computes an upright trapezoid of its strip, losing a column on each
+// side with every row, which only needs its own rows and the block above:
+//
+//     row 0   |##########|##########|##########|
+//     row 1   |#########  ########  #########|
+//     row 2   |########    ######    ########|
+//
+// Each thread then fills in the upside down triangle between its strip and
+// the one to its left, which needs both trapezoids. Rather than a barrier
+// per block, each thread waits only on the neighbors it reads from, using
+// a ready flag per trapezoid and per triangle.
+//
+// A thread only starts a block once both neighbors have finished the block
+// before it, so nobody is still reading a row more than two blocks above
+// any row being written. That's what lets rollACMRows reuse rows.
+template <typename span_t>
+void sweepACM(int width, int height, int firstRow, span_t span) {
+    int interior = width - 2;
     int maxThreads = omp_get_max_threads();
-    int separationPoint = height / maxThreads;
+    acm_ready_flag_t *trapezoidReady = new acm_ready_flag_t[maxThreads + 1];
+    acm_ready_flag_t *triangleReady = new acm_ready_flag_t[maxThreads + 1];
+    for (int i = 0; i <= maxThreads; i++) {
+        trapezoidReady[i].blocks.store(0);
+        triangleReady[i].blocks.store(0);
+    }
 
-    #pragma omp parallel num_threads(omp_get_max_threads())
+    #pragma omp parallel num_threads(maxThreads)
     {
-        // Get the index of this thread.
+        // Every strip needs to be at least 4 columns wide, so its trapezoid
+        // keeps a column or two after losing one each side per row.
         int threadNum = omp_get_thread_num();
+        int strips = std::min(omp_get_num_threads(), interior / 4);
+
+        if (strips <= 1) {
+            if (threadNum == 0) {
+                for (int row = firstRow; row < height; row++) {
+                    span(row, 1, width - 1);
+                }
+            }
+        } else if (threadNum < strips) {
+            int stripLow = 1 + ((threadNum * interior) / strips);
+            int stripHigh = 1 + (((threadNum + 1) * interior) / strips);
+            int blockRows = std::max(2, std::min(ACM_TILE_ROWS, (interior / strips) / 2));
+            bool leftEdge = (threadNum == 0);
+            bool rightEdge = (threadNum == (strips - 1));
+
+            int block = 0;
+            for (int rowLow = firstRow; rowLow < height; rowLow += blockRows, block++) {
+                int rowHigh = std::min(rowLow + blockRows, height);
+
+                // Our trapezoid starts from the bottom rows of the triangles
+                // on either side of it in the last block.
+                if (!leftEdge) {
+                    waitForACMFlag(&triangleReady[threadNum], block);
+                }
+                if (!rightEdge) {
+                    waitForACMFlag(&triangleReady[threadNum + 1], block);
+                }
+
+                // The image edges don't need a triangle, so the trapezoid
+                // keeps its full width on those sides.
+                for (int row = rowLow; row < rowHigh; row++) {
+                    int i = row - rowLow;
+                    span(row, leftEdge ? stripLow : (stripLow + i), rightEdge ? stripHigh : (stripHigh - i));
+                }
+                trapezoidReady[threadNum].blocks.store(block + 1, std::memory_order_release);
+
+                // The triangle between us and the strip to our left.
+                if (!leftEdge) {
+                    waitForACMFlag(&trapezoidReady[threadNum - 1], block + 1);
+                    for (int row = rowLow + 1; row < rowHigh; row++) {
+                        int i = row - rowLow;
+                        span(row, stripLow - i, stripLow + i);
+                    }
+                    triangleReady[threadNum].blocks.store(block + 1, std::memory_order_release);
+                }
+            }
+        }
+    }
 
-        // Calculate the region for which we want this thread to generate the ACM
-        int low;
-        int high;
+    delete[] trapezoidReady;
+    delete[] triangleReady;
+}
 
-        // If we're doing the top region, make sure low is row 2
-        if (threadNum == 0) {
-            low = 2;
-            high = separationPoint;
 
-        // If we're doing the bottom region, make sure high is our lowest row (exclusive)
-        } else if (threadNum == (maxThreads - 1)) {
-            low = threadNum * separationPoint;
-            high = height;
+// Perform the ACM generation step of our algorithm, straight from the
+// energy, noting every entry's parent as we go unless parents is NULL.
+// This is parallelized across OpenMP threads by sweepACM, and matches the
+// sequential ACM exactly. Rows 0 and 1 are left as their energy.
+template <typename energy_t, typename cost_t>
+void calculateACM(const pitched_energy_t<energy_t> &energy, cost_t **acm, acm_parents_t *parents, int width,
+                  int height) {
+    setACMEdgeColumns(acm, width, height, maxCost<cost_t>());
+    calculateACMSpanFromEnergy(energy, acm, parents, 0, 1, width - 1);
+    sweepACM(width, height, 1, [=](int row, int colLow, int colHigh) {
+        calculateACMSpanFromEnergy(energy, acm, parents, row, colLow, colHigh);
+    });
+}
 
-        // Otherwise, just perform a multiplier calculation of our region based on 
-        // our thread index.
-        } else {
-            low = threadNum * separationPoint;
-            high = (threadNum + 1) * separationPoint;
-        }
 
-        calculateACMForRegion(acm, width, height, low, high);
-    }
+// Forward energy (Rubinstein et al., "Improved Seam Carving for Video
+// Retargeting") charges a seam for the edges it creates rather than the
+// energy of the pixels it removes. Taking pixel (row, col) out joins its
+// left and right neighbors, and joins the pixel above to one of them
+// depending on which way the seam came from:
+//
+//   up:        |right - left|
+//   upLeft:    |right - left| + |above - left|
+//   upRight:   |right - left| + |above - right|
+//
+// Costs are raw channel gradients in both pipelines, so they're exact in
+// doubles too. This is what generateSeam uses to retrace the ACM. The
+// pixels' rows are pitch apart.
+template <typename cost_t>
+inline void forwardCosts(const pixel *pixels, int pitch, int row, int col,
+                         cost_t *costUpLeft, cost_t *costUp, cost_t *costUpRight) {
+    const pixel *above = pixels + INDEX(row-1, col, pitch);
+    const pixel *here = pixels + INDEX(row, col, pitch);
+
+    int joined = channelDelta(here[1], here[-1]);
+    *costUp = (cost_t)joined;
+    *costUpLeft = (cost_t)(joined + channelDelta(above[0], here[-1]));
+    *costUpRight = (cost_t)(joined + channelDelta(above[0], here[1]));
 }
 
 
-// Generates an integer array representing the cheapest seam we can remove.
-// This is optimized by using an average of the lowest row of every vertical
-// region (explained thoroughly in project report).
-void generateSeam(double *acm, int *seam, int cols, int rows) {
+// What we put in the edge columns of a forward ACM so the sweep never steps
+// onto them. Half the largest cost, so adding a step's cost can't overflow.
+template <typename cost_t> inline cost_t forwardEdgeCost() {
+    return maxCost<cost_t>() / 2;
+}
 
-    // Initialize an array representing the averages of all the 
-    // bottom rows of each vertical region.
-    double rowAverages[cols];
-    int maxThreads = omp_get_max_threads();
-    int separationPoint = rows / maxThreads;
-    for (int i = 0; i < cols; i++) {
-        rowAverages[i] = (double)0.0;
+
+// The forward energy version of calculateACMSpan, which notes parents the
+// same way. Each ACM entry is the cheapest path to it plus the cost of the
+// step it took. The three gradients behind those costs are worked out for
+// the span from the pixels with the energy kernel, so there's no energy
+// matrix to keep, and the sweep itself is a branch-free loop the compiler
+// can vectorize.
+template <typename cost_t>
+inline void calculateForwardACMSpan(const pixel *pixels, cost_t **acm, acm_parents_t *parents, int pitch,
+                                    int row, int colLow, int colHigh) {
+    int count = colHigh - colLow;
+    if (count <= 0) {
+        return;
     }
 
-    // Iterate through every vertical region
-    for (int tid = 0; tid < maxThreads; tid++) {
-        // Determine the row we want to look at based on our thread
-        int separationRow = (tid == (maxThreads - 1)) ? (rows - 1)
-                                                      : ((tid * separationPoint) - 1);
-    
-        // For our row, sum each column's corresponding ACM value
-        for (int col = 1; col < cols - 1; col++) {
-            rowAverages[col] += acm[INDEX(separationRow, col, cols)];
+    // The kernel fills in entries 1 to count of these for columns colLow
+    // to colHigh - 1, so we hand it everything from column colLow - 1.
+    uint16_t joined[count + 2];
+    uint16_t aboveLeft[count + 2];
+    uint16_t aboveRight[count + 2];
+    const pixel *above = pixels + INDEX(row-1, colLow - 1, pitch);
+    const pixel *here = pixels + INDEX(row, colLow - 1, pitch);
+    pixelDeltas(here + 1, here - 1, joined, count + 2);
+    pixelDeltas(above, here - 1, aboveLeft, count + 2);
+    pixelDeltas(above, here + 1, aboveRight, count + 2);
+
+    const cost_t *acmAbove = acm[row-1] + colLow - 1;
+    cost_t *acmRow = acm[row] + colLow - 1;
+
+    if (!parents) {
+        for (int i = 1; i <= count; i++) {
+            cost_t upLeft = acmAbove[i-1] + (cost_t)(joined[i] + aboveLeft[i]);
+            cost_t up = acmAbove[i] + (cost_t)joined[i];
+            cost_t upRight = acmAbove[i+1] + (cost_t)(joined[i] + aboveRight[i]);
+
+            acmRow[i] = min(upLeft, up, upRight);
         }
+        return;
     }
 
-    // Now we can iterate through our columns and average out our sums based on our thread count.
-    for (int col = 1; col < cols - 1; col++) {
-        rowAverages[col] = (rowAverages[col] / ((double)maxThreads));
-    }
+    uint8_t directions[count + 1];
+    for (int i = 1; i <= count; i++) {
+        cost_t upLeft = acmAbove[i-1] + (cost_t)(joined[i] + aboveLeft[i]);
+        cost_t up = acmAbove[i] + (cost_t)joined[i];
+        cost_t upRight = acmAbove[i+1] + (cost_t)(joined[i] + aboveRight[i]);
 
-    
-    // We can now use rowAverages to determine the column root of our seam.
-    double smallestVal = -1;
-    double smallestCol = -1;
-    for (int col = 1; col < cols - 1; col++) {
-        double thisVal = rowAverages[col];
-        if (thisVal < smallestVal || smallestCol == -1) {
-            smallestCol = col;
-            smallestVal = thisVal;
-        }
+        acmRow[i] = min(upLeft, up, upRight);
+        directions[i] = acmParentDirection(upLeft, up, upRight);
     }
+    acm_parents_store(parents, row, colLow, colHigh, directions + 1);
+}
 
-    int upwardCol = smallestCol;
 
-    // Start in the bottom row, iterate upwards
-    for (int row = rows - 1; row >= 0; row--) {
+// Builds the forward energy ACM straight from the pixels, in parallel the
+// same way as calculateACM, parents and all. Every seam starts off free in
+// the top row. The pixels' rows are pitch apart.
+template <typename cost_t>
+void calculateForwardACM(const pixel *pixels, cost_t **acm, acm_parents_t *parents, int width, int height,
+                         int pitch) {
+    for (int col = 1; col < (width - 1); col++) {
+        acm[0][col] = 0;
+    }
+    setACMEdgeColumns(acm, width, height, forwardEdgeCost<cost_t>());
 
-        // Keep track of the column we're at in this row
-        seam[row] = upwardCol;
+    sweepACM(width, height, 1, [=](int row, int colLow, int colHigh) {
+        calculateForwardACMSpan(pixels, acm, parents, pitch, row, colLow, colHigh);
+    });
+}
 
-         // Don't keep looking upward if in the top row
-        if (row == 0) {
-            continue;
-        }
 
-        // Retrieve the ACM values upLeft, up, and upRight
-        double upLeft;
-        if (upwardCol == 1) {
-            upLeft = DBL_MAX;
-        } else {
-            upLeft = acm[INDEX(row-1, upwardCol-1, cols)];
-        }
+// The bottom row of band band, when the rows are split into bands of
+// (nearly) equal height. The last band takes what's left over.
+inline int bandBottomRow(int band, int bands, int rows) {
+    if (band == (bands - 1)) {
+        return rows - 1;
+    }
+    return ((band + 1) * (rows / bands)) - 1;
+}
 
-        double up = acm[INDEX(row-1, upwardCol, cols)];
 
-        double upRight;
-        if (upwardCol == (cols - 2)) {
-            upRight = DBL_MAX;
-        } else {
-            upRight = acm[INDEX(row-1, upwardCol+1, cols)];
-        }
+// Points the rows of an ACM we only need the seam from (it's traced from
+// the parents) into a ring of ACM_RING_ROWS buffers, so the sweep works in
+// cache rather than streaming a whole matrix out to memory. The rows
+// seamRootCosts reads afterwards (the bottom row of each of bands bands)
+// get buffers of their own in kept, which needs room for bands rows. Both
+// are pitch entries a row.
+template <typename cost_t>
+void rollACMRows(cost_t **acm, cost_t *ring, cost_t *kept, int height, int pitch, int bands) {
+    for (int row = 0; row < height; row++) {
+        acm[row] = ring + INDEX(row % ACM_RING_ROWS, 0, pitch);
+    }
+    for (int band = 0; band < bands; band++) {
+        acm[bandBottomRow(band, bands, height)] = kept + INDEX(band, 0, pitch);
+    }
+}
 
 
-        // Retrieve the minimum of upLeft, up, and upRight.
-        double smallest = min(upLeft, up, upRight);
+// The band-approximate ACM (our original parallel ACM). The rows are split
+// into bands, one per thread, and each thread computes its band on its own
+// as if the image started halo rows above it (plus the one row above the
+// band it always needs), so there's no waiting on other threads at all.
+// Paths coming in from further up are cut off, which is the approximation:
+// the more halo rows, the closer a band gets to the exact ACM, and with
+// halo past the top of the image it is exact.
+//
+// start(rows, row) fills in the row a band starts from, and span(rows,
+// parents, row, colLow, colHigh) computes a span from the row above, like
+// calculateACMSpan. rows is the thread's own array of row pointers, and
+// the halo rows (which belong to the band above) take turns in two scratch
+// rows. Walking the ACM, the band's own rows go in acm's, where
+// generateSeam looks, so it follows a seam across into the band above by
+// that band's ACM, not the halo's. With parents, which are only noted for
+// the band's own rows, the seam's first step into the band above is the
+// one the halo picked, and only the band's bottom row (for seamRootCosts)
+// needs to go in acm's; the rest share the scratch rows too.
+template <typename cost_t, typename start_t, typename span_t>
+void sweepACMBands(cost_t **acm, acm_parents_t *parents, int width, int height, int bands, int halo,
+                   cost_t edge, start_t start, span_t span) {
+    int bandRows = height / bands;
+
+    #pragma omp parallel for schedule(static)
+    for (int band = 0; band < bands; band++) {
+        int low = band * bandRows;
+        int bottom = bandBottomRow(band, bands, height);
+        int first = (band == 0) ? 0 : std::max(0, low - 1 - halo);
+
+        cost_t scratch[2 * width];
+        cost_t *rows[height];
+        scratch[0] = scratch[width - 1] = edge;
+        scratch[width] = scratch[(2 * width) - 1] = edge;
+        for (int row = first; row <= bottom; row++) {
+            bool kept = (row == bottom) || ((row >= low) && !parents);
+            rows[row] = kept ? acm[row] : (scratch + ((row & 1) * width));
+        }
 
-        // Increase or decrease our column based on whicheer
-        // pixel was the smallest.
-        if (smallest == upLeft) {
-            upwardCol--;
-        } else if (smallest == upRight) {
-            upwardCol++;
+        start(rows, first);
+        for (int row = first + 1; row <= bottom; row++) {
+            span(rows, (row >= low) ? parents : NULL, row, 1, width - 1);
         }
-     }
+    }
 }
 
 
-// This is the step that removes the seam from our image given a helper
-// temp_pixels array. This step is parallelized across rows.
-void removeSeam(pixel *pixels, pixel *temp_pixels, int *seam, int iterationWidth, int height) {
+// calculateACM for the band-approximate ACM (see sweepACMBands). Each band
+// starts from plain energy.
+template <typename energy_t, typename cost_t>
+void calculateACMBands(const pitched_energy_t<energy_t> &energy, cost_t **acm, acm_parents_t *parents, int width,
+                       int height, int bands, int halo) {
+    setACMEdgeColumns(acm, width, height, maxCost<cost_t>());
+    sweepACMBands(acm, parents, width, height, bands, halo, maxCost<cost_t>(),
+        [=](cost_t **rows, int row) {
+            loadEnergySpan(energy, row, 1, width - 1, rows[row]);
+        },
+        [=](cost_t **rows, acm_parents_t *rowParents, int row, int colLow, int colHigh) {
+            calculateACMSpanFromEnergy(energy, rows, rowParents, row, colLow, colHigh);
+        });
+}
 
-    // Now that we have the seam, we should remove it from our image
-    #pragma omp parallel for 
-    for (int row = 0; row < height; row++) {
-        bool passedSeam = false;
-        int colToRemove = seam[row];
-        pixel rowPixels[iterationWidth];
 
-        // Until we encounter the seam column, just copy our image.
-        // Once we do, copy the pixels shifted over left by one.
-        for (int col = 0; col < iterationWidth; col++) {
-            if (col < colToRemove) {
-                rowPixels[col].r = pixels[INDEX(row, col, iterationWidth)].r;
-                rowPixels[col].g = pixels[INDEX(row, col, iterationWidth)].g;
-                rowPixels[col].b = pixels[INDEX(row, col, iterationWidth)].b;
-            } else if (col > colToRemove) {
-                rowPixels[col-1].r = pixels[INDEX(row, col, iterationWidth)].r;
-                rowPixels[col-1].g = pixels[INDEX(row, col, iterationWidth)].g;
-                rowPixels[col-1].b = pixels[INDEX(row, col, iterationWidth)].b;
+// calculateForwardACM for the band-approximate ACM. Every seam starts off
+// free in the row each band starts from.
+template <typename cost_t>
+void calculateForwardACMBands(const pixel *pixels, cost_t **acm, acm_parents_t *parents, int width, int height,
+                              int pitch, int bands, int halo) {
+    setACMEdgeColumns(acm, width, height, forwardEdgeCost<cost_t>());
+    sweepACMBands(acm, parents, width, height, bands, halo, forwardEdgeCost<cost_t>(),
+        [=](cost_t **rows, int row) {
+            for (int col = 1; col < (width - 1); col++) {
+                rows[row][col] = 0;
             }
-        }
-
-        memcpy(&temp_pixels[INDEX(row, 0, (iterationWidth-1))], rowPixels, (iterationWidth-1) * sizeof(pixel));
-    }
+        },
+        [=](cost_t **rows, acm_parents_t *rowParents, int row, int colLow, int colHigh) {
+            calculateForwardACMSpan(pixels, rows, rowParents, pitch, row, colLow, colHigh);
+        });
+}
 
-    iterationWidth--;
 
-    memcpy(pixels, temp_pixels, sizeof(pixel) * iterationWidth * height);
+// Takes a seam out of an ACM whose rows stay pitch apart, by sliding each
+// row's entries right of the seam one to the left, and the same for its
+// parents if it has them. Unlike removing it from a packed matrix, nothing
+// left of the seam moves, and the rows are independent so they're done in
+// parallel. width is the width before.
+template <typename cost_t>
+void removeSeamFromACM(cost_t **acm, acm_parents_t *parents, int *seam, int width, int height) {
+    #pragma omp parallel for schedule(static)
+    for (int row = 0; row < height; row++) {
+        int col = seam[row];
+        memmove(acm[row] + col, acm[row] + col + 1, sizeof(cost_t) * (width - col - 1));
+        if (parents) {
+            acm_parents_remove_column(parents, row, col, width);
+        }
+    }
 }
 
 
-// This function is identical to that of the removeSeam function except that
-// it removes the seam from our energy matrix rather than from the image.
-void removeSeamFromEnergy(double *energy, double *temp_energy, int *seam, int iterationWidth, int height) {
+// Brings the ACM of the last iteration up to date after a seam has been
+// removed from it (see removeSeamFromACM). Only the entries below the seam
+// can change: in every row, the few columns around the seam whose energy
+// or neighbors changed, plus anything under an entry that changed in the
+// row above. So we go down the rows recomputing just that band, and the
+// band only widens where the values actually came out different, and
+// narrows back to the seam as soon as they match again.
+//
+// span(row, colLow, colHigh) recomputes the ACM entries [colLow, colHigh)
+// of a row from scratch, parents included if there are any. Returns how
+// many entries were recomputed.
+template <typename cost_t, typename span_t>
+long updateACMAlongSeam(cost_t **acm, int *seam, int width, int height, span_t span) {
+    cost_t previous[width];
+    long recomputed = 0;
+    int changedLow = width;
+    int changedHigh = -1;
 
-    // Now that we have the seam, we should remove it from our image
-    #pragma omp parallel for 
     for (int row = 0; row < height; row++) {
-        bool passedSeam = false;
-        int colToRemove = seam[row];
 
-        // Until we encounter the seam column, just copy our image.
-        // Once we do, copy the pixels shifted over left by one.
-        for (int col = 0; col < iterationWidth; col++) {
-            if (col < colToRemove) {
-                temp_energy[INDEX(row, col, (iterationWidth-1))] = energy[INDEX(row, col, iterationWidth)];
-            } else if (col > colToRemove) {
-                temp_energy[INDEX(row, (col-1), (iterationWidth-1))] = energy[INDEX(row, col, iterationWidth)];
+        // The same columns calculateEnergyAlongSeam recomputes, plus the
+        // ones under last row's changes.
+        int low = std::max(1, seam[row] - 2);
+        int high = std::min(width - 2, seam[row] + 2);
+        if (changedLow <= changedHigh) {
+            low = std::min(low, std::max(1, changedLow - 1));
+            high = std::max(high, std::min(width - 2, changedHigh + 1));
+        }
+        if (low > high) {
+            changedLow = width;
+            changedHigh = -1;
+            continue;
+        }
+
+        cost_t *acmRow = acm[row];
+        memcpy(previous + low, acmRow + low, sizeof(cost_t) * (high - low + 1));
+        span(row, low, high + 1);
+        recomputed += high - low + 1;
+
+        changedLow = width;
+        changedHigh = -1;
+        for (int col = low; col <= high; col++) {
+            if (acmRow[col] != previous[col]) {
+                changedLow = std::min(changedLow, col);
+                changedHigh = col;
             }
         }
     }
 
-    iterationWidth--;
-
-    memcpy(energy, temp_energy, sizeof(double) * iterationWidth * height);
+    return recomputed;
 }
 
 
+// Works out what a seam rooted at each column of the bottom row costs, from
+// the bottom rows of bands bands of the ACM. With one band that's just the
+// last row, the exact answer. With more (for the band-approximate ACM, see
+// sweepACMBands) we average the lowest row of every vertical region
+// (explained thoroughly in project report).
+template <typename cost_t>
+void seamRootCosts(cost_t **acm, double *rowAverages, int cols, int rows, int bands) {
 
+    // Initialize an array representing the averages of all the 
+    // bottom rows of each vertical region.
+    for (int i = 0; i < cols; i++) {
+        rowAverages[i] = (double)0.0;
+    }
 
+    // Iterate through every vertical region
+    for (int band = 0; band < bands; band++) {
+        const cost_t *regionRow = acm[bandBottomRow(band, bands, rows)];
 
-int main(int argc, const char *argv[])
-{
-  using namespace std::chrono;
-  typedef std::chrono::high_resolution_clock Clock;
-  typedef std::chrono::duration<double> dsec;
-
-  auto init_start = Clock::now();
-  double init_time = 0;
- 
-  _argc = argc - 1;
-  _argv = argv + 1;
+        // For our row, sum each column's corresponding ACM value
+        for (int col = 1; col < cols - 1; col++) {
+            rowAverages[col] += regionRow[col];
+        }
+    }
 
-  const char *input_filename = get_option_string("-f", NULL);
-  int num_of_threads = get_option_int("-n", 1);
+    // Now we can iterate through our columns and average out our sums based on our band count.
+    for (int col = 1; col < cols - 1; col++) {
+        rowAverages[col] = (rowAverages[col] / ((double)bands));
+    }
+}
 
-  
-  printf("Number of threads: %d\n", num_of_threads);
-  printf("Input file: %s\n", input_filename);
 
+// Which way a seam through ACM entry (row, col) goes up to the row above:
+// -1, 0 or 1 for up and left, straight up or up and right. If the sweep
+// noted every entry's parent (parents isn't NULL), it's the one it noted.
+// Otherwise it's whichever of the three entries above is the smallest, the
+// same way the ACM sweep picked its min. For a forward ACM (when
+// forwardPixels isn't NULL, with its rows pitch apart) that's with each
+// step's cost added on, exactly as calculateForwardACMSpan did. Either way
+// ties go up and left, then up and right, then straight up, the way
+// generateSeam always has.
+template <typename cost_t>
+inline int seamStep(cost_t **acm, const acm_parents_t *parents, const pixel *forwardPixels, int pitch, int row,
+                    int col) {
+    if (parents) {
+        return acm_parent(parents, row, col) - acmParentUp;
+    }
 
-  // Read each line of our provided image text file
-  // line by line.
-  FILE *input = fopen(input_filename, "r");
+    const cost_t *above = acm[row-1];
+    cost_t upLeft = above[col-1];
+    cost_t up = above[col];
+    cost_t upRight = above[col+1];
+    if (forwardPixels) {
+        cost_t costUpLeft, costUp, costUpRight;
+        forwardCosts(forwardPixels, pitch, row, col, &costUpLeft, &costUp, &costUpRight);
+        upLeft = upLeft + costUpLeft;
+        up = up + costUp;
+        upRight = upRight + costUpRight;
+    }
 
-  if (!input) {
-    printf("Unable to open file: image_rgb.txt.\n");
-    return 1;
-  }
+    if ((upLeft <= up) && (upLeft <= upRight)) {
+        return -1;
+    }
+    return (upRight <= up) ? 1 : 0;
+}
 
-  // The first line of the image will be the dimensions.
-  int width, height;
-  fscanf(input, "%d %d\n", &width, &height);
-
-  pixel *pixels = (pixel *)calloc(width * height, sizeof(pixel));
-
-  // The rest of the image will be the pixel values at each cooordinate.
-  int rval, gval, bval;
-  int i = 0;
-  while (fscanf(input, "%d %d %d\n", &rval, &gval, &bval) != EOF) {
-    pixels[i].r = (uint8_t)rval;
-    pixels[i].g = (uint8_t)gval;
-    pixels[i].b = (uint8_t)bval;
-    i++;
-  }
 
-  fclose(input);
-  
-  printf("Width: %d, Height: %d, i: %d\n", width, height, i);
+// Follows the parent table up from column col of the bottom row, filling
+// in all rows of seam. Each step is one load from the row above, so this
+// doesn't touch the ACM at all.
+inline void traceSeamParents(const acm_parents_t *parents, int *seam, int col, int rows) {
+    for (int row = rows - 1; row > 0; row--) {
+        seam[row] = col;
+        col += acm_parent(parents, row, col) - acmParentUp;
+    }
+    seam[0] = col;
+}
 
 
+// Generates an integer array representing the cheapest seam we can remove.
+// The seam's root is the cheapest column by seamRootCosts, and from there we
+// walk up a row at a time with seamStep. parents is the ACM's parent
+// table, or NULL to retrace the ACM, and forwardPixels and pitch are the
+// pixels of a forward ACM (see seamStep), or NULL.
+template <typename cost_t>
+void generateSeam(cost_t **acm, const acm_parents_t *parents, const pixel *forwardPixels, int pitch, int *seam,
+                  int cols, int rows, int bands) {
+    double rowAverages[cols];
+    seamRootCosts(acm, rowAverages, cols, rows, bands);
 
-  init_time += duration_cast<dsec>(Clock::now() - init_start).count();
-  printf("Initialization Time: %lf.\n", init_time);
+    // We can now use rowAverages to determine the column root of our seam.
+    double smallestVal = -1;
+    double smallestCol = -1;
+    for (int col = 1; col < cols - 1; col++) {
+        double thisVal = rowAverages[col];
+        if (thisVal < smallestVal || smallestCol == -1) {
+            smallestCol = col;
+            smallestVal = thisVal;
+        }
+    }
 
+    // Start in the bottom row and walk upwards.
+    int upwardCol = smallestCol;
+    if (parents) {
+        traceSeamParents(parents, seam, upwardCol, rows);
+        return;
+    }
+    for (int row = rows - 1; row > 0; row--) {
+        seam[row] = upwardCol;
+        upwardCol += seamStep(acm, parents, forwardPixels, pitch, row, upwardCol);
+    }
+    seam[0] = upwardCol;
+}
 
-  auto compute_start = Clock::now();
-  double compute_time = 0;
 
-  #ifdef RUN_MIC /* Use RUN_MIC to distinguish between the target of compilation */
+// Generates up to count seams from one ACM, which don't share a pixel or
+// cross each other, so they can all be removed at once. The roots are
+// tried from the cheapest up (by seamRootCosts), and each seam walks up
+// the ACM like generateSeam's. A seam that runs into (or across) one we
+// already have is dropped, and we try the next root. (Steering it around
+// the other seam instead finds more seams a pass, but they're much worse:
+// it's mostly the cheap paths that merge.) Neighboring roots often share a
+// path, so we can find fewer than count.
+//
+// With a parent table, a root's path is just a chain of loads from it, so
+// several are in flight at once: the next batch of roots (one per thread)
+// is traced in parallel, and then checked against the seams so far in
+// order, which picks exactly the seams walking them one at a time would.
+//
+// Seam i goes in seams[i * rows] to seams[(i * rows) + rows - 1], and
+// they're sorted left to right. Seams that don't cross stay in the same
+// order in every row, so removeSeams can take them out in one pass.
+// Returns how many seams it found.
+template <typename cost_t>
+int generateSeams(cost_t **acm, const acm_parents_t *parents, const pixel *forwardPixels, int pitch, int *seams,
+                  int count, int cols, int rows, int bands) {
+    double rowAverages[cols];
+    seamRootCosts(acm, rowAverages, cols, rows, bands);
 
-  /* This pragma means we want the code in the following block be executed in 
-   * Xeon Phi.
-   */
-#pragma offload target(mic) \
-  inout(pixels: length(width * height) INOUT)
-#endif
-  {
-    // Set our thread count.
-    omp_set_num_threads(num_of_threads);
+    // The columns of the bottom row, cheapest first. Ties go to the left,
+    // like generateSeam.
+    std::vector<int> roots;
+    for (int col = 1; col < cols - 1; col++) {
+        roots.push_back(col);
+    }
+    std::stable_sort(roots.begin(), roots.end(),
+                     [&](int a, int b) { return rowAverages[a] < rowAverages[b]; });
+
+    // Which pixels the seams so far go through.
+    std::vector<uint8_t> taken((size_t)cols * rows, 0);
+    std::vector<int> seam(rows);
+    std::vector<int> order;
+
+    // The paths traced ahead from the parents, for roots [batchLow,
+    // batchHigh).
+    int batch = parents ? std::max(1, omp_get_max_threads()) : 0;
+    std::vector<int> paths((size_t)batch * rows);
+    size_t batchLow = 0;
+    size_t batchHigh = 0;
+
+    int found = 0;
+    for (size_t root = 0; (root < roots.size()) && (found < count); root++) {
+        int upwardCol = roots[root];
+        if (taken[INDEX(rows - 1, upwardCol, cols)]) {
+            continue;
+        }
+
+        if (parents && (root >= batchHigh)) {
+            batchLow = root;
+            batchHigh = std::min(roots.size(), root + batch);
+            #pragma omp parallel for schedule(static, 1)
+            for (size_t next = batchLow; next < batchHigh; next++) {
+                if (!taken[INDEX(rows - 1, roots[next], cols)]) {
+                    traceSeamParents(parents, &paths[(next - batchLow) * rows], roots[next], rows);
+                }
+            }
+        }
+        const int *path = parents ? &paths[(root - batchLow) * rows] : NULL;
+
+        bool blocked = false;
+        for (int row = rows - 1; (row > 0) && !blocked; row--) {
+            seam[row] = upwardCol;
+            int nextCol = path ? path[row - 1]
+                               : (upwardCol + seamStep(acm, parents, forwardPixels, pitch, row, upwardCol));
+
+            // Stepping diagonally past a seam that steps the other way
+            // across us would cross it.
+            blocked = taken[INDEX(row - 1, nextCol, cols)] ||
+                      ((nextCol != upwardCol) && taken[INDEX(row, nextCol, cols)] &&
+                       taken[INDEX(row - 1, upwardCol, cols)]);
+            upwardCol = nextCol;
+        }
+        if (blocked) {
+            continue;
+        }
+        seam[0] = upwardCol;
+
+        for (int row = 0; row < rows; row++) {
+            taken[INDEX(row, seam[row], cols)] = 1;
+        }
+        memcpy(seams + ((size_t)found * rows), seam.data(), sizeof(int) * rows);
+        order.push_back(found);
+        found++;
+    }
+
+    // Sort them left to right by their bottom column.
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return seams[((size_t)a * rows) + rows - 1] < seams[((size_t)b * rows) + rows - 1];
+    });
+    std::vector<int> sorted((size_t)found * rows);
+    for (int i = 0; i < found; i++) {
+        memcpy(&sorted[(size_t)i * rows], seams + ((size_t)order[i] * rows), sizeof(int) * rows);
+    }
+    if (found > 0) {
+        memcpy(seams, sorted.data(), sizeof(int) * sorted.size());
+    }
+    return found;
+}
+
+
+// Everything the pyramid seam search (see calculatePyramidACM) needs from
+// one seam to the next, allocated for the image's starting size.
+template <typename cost_t>
+struct acm_pyramid_t
+{
+	// The image is shrunk by factor each way, and the full size ACM is
+	// only computed band columns either side of the seam from there.
+	int factor;
+	int band;
+
+	// The shrunk image: its energy, or its pixels for forward energy, and
+	// its ACM. With parents, the ACM is a ring (see rollACMRows) and the
+	// seam is traced from coarseParents; otherwise coarseParents.words is
+	// NULL and the ACM is whole.
+	cost_t *coarseEnergy;
+	pixel *coarsePixels;
+	cost_t *coarseMatrix;
+	cost_t **coarseAcm;
+	acm_parents_t coarseParents;
+	int *coarseSeam;
+
+	// Where the band ended up in the last row.
+	int lastLow;
+	int lastHigh;
+};
+
+
+template <typename cost_t>
+void acm_pyramid_alloc(acm_pyramid_t<cost_t> *pyramid, int levels, int band, int width, int height, bool parents) {
+    pyramid->factor = 1 << levels;
+    pyramid->band = std::max(band, pyramid->factor);
+    int coarseWidth = width / pyramid->factor;
+    int coarseHeight = (height + pyramid->factor - 1) / pyramid->factor;
+    pyramid->coarseParents.words = NULL;
+    pyramid->coarseParents.rowWords = 0;
+    if (parents) {
+        pyramid->coarseParents = acm_parents_alloc(coarseWidth, coarseHeight);
+    }
+    int coarseRows = pyramid->coarseParents.words ? (ACM_RING_ROWS + 1) : coarseHeight;
+    pyramid->coarseEnergy = (cost_t *)malloc(sizeof(cost_t) * coarseWidth * coarseHeight);
+    pyramid->coarsePixels = (pixel *)malloc(sizeof(pixel) * coarseWidth * coarseHeight);
+    pyramid->coarseMatrix = (cost_t *)calloc(coarseWidth * coarseRows, sizeof(cost_t));
+    pyramid->coarseAcm = (cost_t **)malloc(sizeof(cost_t *) * coarseHeight);
+    pyramid->coarseSeam = (int *)malloc(sizeof(int) * coarseHeight);
+}
+
+
+template <typename cost_t>
+void acm_pyramid_free(acm_pyramid_t<cost_t> *pyramid) {
+    free(pyramid->coarseEnergy);
+    free(pyramid->coarsePixels);
+    free(pyramid->coarseMatrix);
+    free(pyramid->coarseAcm);
+    acm_parents_free(&pyramid->coarseParents);
+    free(pyramid->coarseSeam);
+}
+
+
+// Whether an image is still big enough for the pyramid to shrink.
+template <typename cost_t>
+inline bool pyramidFits(const acm_pyramid_t<cost_t> *pyramid, int width, int height) {
+    return ((width / pyramid->factor) >= 4) && (height >= pyramid->factor);
+}
+
+
+// The multi-resolution ACM. We shrink the image by pyramid->factor each way
+// (adding up the energy of each block, or averaging its pixels for forward
+// energy), find the cheapest seam of that with the usual ACM, and scale it
+// back up. Then the full size ACM is only computed in a band of
+// pyramid->band columns either side of that seam, so a seam costs
+// O(width * height / factor^2 + height * band) instead of O(width * height).
+// Within the band it's the exact DP, so the seam is the cheapest one that
+// stays inside it. The band goes in acm, the carve's ACM rows, of which
+// only the band and the columns either side of it are touched. Those are
+// a whole ACM, or with parents (which the band's rows go in as usual) a
+// ring of rows, since then nothing reads them again but the last row.
+//
+// Columns outside the band of the row above count as half the largest
+// cost, like forwardEdgeCost: more than any path, and never enough to
+// overflow what gets added to them. The rows of the pixels and the energy
+// are pitch apart. Returns how many ACM entries it computed: all of the
+// shrunk image's, and the band's as it was actually clipped to the image.
+template <typename energy_t, typename cost_t>
+long calculatePyramidACM(acm_pyramid_t<cost_t> *pyramid, const pixel *pixels, const energy_t *energy,
+                         cost_t **acm, acm_parents_t *parents, int width, int height, int pitch, bool forward) {
+    int factor = pyramid->factor;
+    int coarseWidth = width / factor;
+    int coarseHeight = (height + factor - 1) / factor;
+
+    // Shrink the image, a row of blocks at a time: first add up the block's
+    // rows column by column, which vectorizes, then each block's columns.
+    // The columns past coarseWidth * factor on the right are left out,
+    // which only means seams start a little further from that edge.
+    int usedWidth = coarseWidth * factor;
+    #pragma omp parallel for
+    for (int coarseRow = 0; coarseRow < coarseHeight; coarseRow++) {
+        int rowLow = coarseRow * factor;
+        int rowEnd = std::min(height, rowLow + factor);
+        if (forward) {
+            int sums[3 * usedWidth];
+            memset(sums, 0, sizeof(sums));
+            for (int row = rowLow; row < rowEnd; row++) {
+                const uint8_t *rowBytes = (const uint8_t *)(pixels + INDEX(row, 0, pitch));
+                for (int i = 0; i < (3 * usedWidth); i++) {
+                    sums[i] += rowBytes[i];
+                }
+            }
+            int count = (rowEnd - rowLow) * factor;
+            for (int coarseCol = 0; coarseCol < coarseWidth; coarseCol++) {
+                int channels[3] = { 0, 0, 0 };
+                for (int col = coarseCol * factor; col < ((coarseCol + 1) * factor); col++) {
+                    channels[0] += sums[3 * col];
+                    channels[1] += sums[(3 * col) + 1];
+                    channels[2] += sums[(3 * col) + 2];
+                }
+                pixel &p = pyramid->coarsePixels[INDEX(coarseRow, coarseCol, coarseWidth)];
+                p.r = (uint8_t)(channels[0] / count);
+                p.g = (uint8_t)(channels[1] / count);
+                p.b = (uint8_t)(channels[2] / count);
+            }
+        } else {
+            cost_t sums[usedWidth];
+            for (int col = 0; col < usedWidth; col++) {
+                sums[col] = 0;
+            }
+            for (int row = rowLow; row < rowEnd; row++) {
+                const energy_t *rowEnergy = energy + INDEX(row, 0, pitch);
+                for (int col = 0; col < usedWidth; col++) {
+                    sums[col] += (cost_t)rowEnergy[col];
+                }
+            }
+            for (int coarseCol = 0; coarseCol < coarseWidth; coarseCol++) {
+                cost_t total = 0;
+                for (int col = coarseCol * factor; col < ((coarseCol + 1) * factor); col++) {
+                    total += sums[col];
+                }
+                pyramid->coarseEnergy[INDEX(coarseRow, coarseCol, coarseWidth)] = total;
+            }
+        }
+    }
+
+    // The cheapest seam of the shrunk image.
+    acm_parents_t *coarseParents = pyramid->coarseParents.words ? &pyramid->coarseParents : NULL;
+    if (coarseParents) {
+        rollACMRows(pyramid->coarseAcm, pyramid->coarseMatrix,
+                    pyramid->coarseMatrix + INDEX(ACM_RING_ROWS, 0, coarseWidth), coarseHeight, coarseWidth, 1);
+    } else {
+        pointACMRows(pyramid->coarseAcm, pyramid->coarseMatrix, coarseHeight, coarseWidth);
+    }
+    if (forward) {
+        calculateForwardACM(pyramid->coarsePixels, pyramid->coarseAcm, coarseParents, coarseWidth,
+                            coarseHeight, coarseWidth);
+    } else {
+        pitched_energy_t<cost_t> coarseEnergy = { pyramid->coarseEnergy, NULL, coarseWidth };
+        calculateACM(coarseEnergy, pyramid->coarseAcm, coarseParents, coarseWidth, coarseHeight);
+    }
+    generateSeam(pyramid->coarseAcm, coarseParents, forward ? pyramid->coarsePixels : (const pixel *)NULL,
+                 coarseWidth, pyramid->coarseSeam, coarseWidth, coarseHeight, 1);
+    long computed = (long)coarseWidth * coarseHeight;
+
+    // The full size ACM around it, a row at a time.
+    pitched_energy_t<energy_t> pitchedEnergy = { energy, NULL, pitch };
+    cost_t edge = forward ? forwardEdgeCost<cost_t>() : maxCost<cost_t>();
+    cost_t outside = forwardEdgeCost<cost_t>();
+    setACMEdgeColumns(acm, width, height, edge);
+
+    int band = pyramid->band;
+    int aboveLow = 0;
+    int aboveHigh = 0;
+    for (int row = 0; row < height; row++) {
+        int center = (pyramid->coarseSeam[row / factor] * factor) + (factor / 2);
+        int colLow = std::max(1, center - band);
+        int colHigh = std::min(width - 1, center + band + 1);
+
+        if (row > 0) {
+            cost_t *above = acm[row - 1];
+            for (int col = std::max(1, colLow - 1); col <= std::min(width - 2, colHigh); col++) {
+                if ((col < aboveLow) || (col >= aboveHigh)) {
+                    above[col] = outside;
+                }
+            }
+        }
+
+        if (!forward) {
+            calculateACMSpanFromEnergy(pitchedEnergy, acm, parents, row, colLow, colHigh);
+        } else if (row == 0) {
+            for (int col = colLow; col < colHigh; col++) {
+                acm[0][col] = 0;
+            }
+        } else {
+            calculateForwardACMSpan(pixels, acm, parents, pitch, row, colLow, colHigh);
+        }
+        computed += colHigh - colLow;
+        aboveLow = colLow;
+        aboveHigh = colHigh;
+    }
+    pyramid->lastLow = aboveLow;
+    pyramid->lastHigh = aboveHigh;
+    return computed;
+}
+
+
+// generateSeam for calculatePyramidACM: the cheapest entry of the band in
+// the last row, and a walk up the band's ACM (or its parents) from there.
+// parents and forwardPixels are as for generateSeam.
+template <typename cost_t>
+void generatePyramidSeam(const acm_pyramid_t<cost_t> *pyramid, cost_t **acm, const acm_parents_t *parents,
+                         const pixel *forwardPixels, int pitch, int *seam, int rows) {
+    const cost_t *lastRow = acm[rows - 1];
+    int upwardCol = pyramid->lastLow;
+    for (int col = pyramid->lastLow + 1; col < pyramid->lastHigh; col++) {
+        if (lastRow[col] < lastRow[upwardCol]) {
+            upwardCol = col;
+        }
+    }
+
+    if (parents) {
+        traceSeamParents(parents, seam, upwardCol, rows);
+        return;
+    }
+    for (int row = rows - 1; row > 0; row--) {
+        seam[row] = upwardCol;
+        upwardCol += seamStep(acm, parents, forwardPixels, pitch, row, upwardCol);
+    }
+    seam[0] = upwardCol;
+}
+
+
+// Takes count seams, laid out like generateSeams leaves them (left to right
+// in every row), out of one row of a matrix, by sliding the spans between
+// them left within the row. Nothing left of the first seam moves.
+template <typename value_t>
+inline void removeSeamsFromRow(value_t *rowValues, const int *seams, int count, int row, int iterationWidth,
+                               int height) {
+    for (int i = 0; i < count; i++) {
+        int low = seams[((size_t)i * height) + row] + 1;
+        int high = ((i + 1) < count) ? seams[((size_t)(i + 1) * height) + row] : iterationWidth;
+        memmove(rowValues + low - (i + 1), rowValues + low, sizeof(value_t) * (high - low));
+    }
+}
+
+
+// This is the step that removes the seams from our image. The rows keep
+// their pitch, so each one just shrinks in place, and the pixels and
+// (unless they're NULL) the energy and one more uint16_t matrix alongside
+// (the seam map's columns, or the integer energy) all go in the same pass
+// over the rows. This step is parallelized across rows, the same rows to a
+// thread each time, so they stay where they were first touched.
+template <typename energy_t>
+void removeSeams(pixel *pixels, energy_t *energy, uint16_t *extra, const int *seams, int count,
+                 int iterationWidth, int height, int pitch) {
+    #pragma omp parallel for schedule(static)
+    for (int row = 0; row < height; row++) {
+        removeSeamsFromRow(pixels + INDEX(row, 0, pitch), seams, count, row, iterationWidth, height);
+        if (energy) {
+            removeSeamsFromRow(energy + INDEX(row, 0, pitch), seams, count, row, iterationWidth, height);
+        }
+        if (extra) {
+            removeSeamsFromRow(extra + INDEX(row, 0, pitch), seams, count, row, iterationWidth, height);
+        }
+    }
+}
+
+
+// Copies the first width entries of each row of in, pitch inPitch, into out,
+// pitch outPitch, the same rows to a thread as removeSeams.
+template <typename value_t>
+void copyRows(const value_t *in, int inPitch, value_t *out, int outPitch, int width, int height) {
+    #pragma omp parallel for schedule(static)
+    for (int row = 0; row < height; row++) {
+        memcpy(out + INDEX(row, 0, outPitch), in + INDEX(row, 0, inPitch), sizeof(value_t) * width);
+    }
+}
+
+
+// Lazy seam removal (see carveImageWith) leaves the pixels and the energy
+// where they are and only takes seams out of an index of each row's
+// entries that are left. The functions below are the parts of the carve
+// loop that see the image through that index. Both the index and what it
+// points into are pitch entries a row.
+
+// Sets every row of the index to list all width entries of its row.
+void identityIndex(uint16_t *index, int width, int height, int pitch) {
+    #pragma omp parallel for schedule(static)
+    for (int row = 0; row < height; row++) {
+        for (int col = 0; col < width; col++) {
+            index[INDEX(row, col, pitch)] = (uint16_t)col;
+        }
+    }
+}
+
+
+// Takes count seams out of the index, laid out like removeSeams takes them.
+// Each row only slides its index entries right of the first seam over.
+void removeSeamsFromIndex(uint16_t *index, int pitch, const int *seams, int count, int iterationWidth,
+                          int height) {
+    #pragma omp parallel for schedule(static)
+    for (int row = 0; row < height; row++) {
+        removeSeamsFromRow(index + INDEX(row, 0, pitch), seams, count, row, iterationWidth, height);
+    }
+}
+
+
+// Packs what the index says is left of each row of values into out, width
+// entries from the start of each of its rows, outPitch apart. Entries
+// left are in order, so out can be values itself, with the same pitch.
+template <typename value_t>
+void compactLazyRows(const value_t *values, const uint16_t *index, int pitch, value_t *out, int outPitch,
+                     int width, int height) {
+    #pragma omp parallel for schedule(static)
+    for (int row = 0; row < height; row++) {
+        const value_t *rowValues = values + INDEX(row, 0, pitch);
+        const uint16_t *indexRow = index + INDEX(row, 0, pitch);
+        value_t *outRow = out + INDEX(row, 0, outPitch);
+        for (int col = 0; col < width; col++) {
+            outRow[col] = rowValues[indexRow[col]];
+        }
+    }
+}
+
+
+// Copies the 3x3 block of pixels around (row, col) of a lazily carved image
+// into block, so an energy policy can work on it as a 3 pixel wide image.
+// The pixels above and below are the ones in the same column of their own
+// rows now, which is what they'd be after packing. (row, col) can't be on
+// the edge.
+inline void gatherNeighborhood(const pixel *pixels, const uint16_t *index, int pitch, int row, int col,
+                               pixel *block) {
+    for (int i = 0; i < 3; i++) {
+        const pixel *rowPixels = pixels + INDEX(row + i - 1, 0, pitch);
+        const uint16_t *indexRow = index + INDEX(row + i - 1, col - 1, pitch);
+        block[INDEX(i, 0, 3)] = rowPixels[indexRow[0]];
+        block[INDEX(i, 1, 3)] = rowPixels[indexRow[1]];
+        block[INDEX(i, 2, 3)] = rowPixels[indexRow[2]];
+    }
+}
+
+
+// calculateEnergyAlongSeam for a lazily carved image. The seam is in the
+// columns of the image as it is now, and energy is written back to where
+// each pixel's value is kept.
+template <typename energy_policy_t, typename energy_t>
+void calculateLazyEnergyAlongSeam(const pixel *pixels, energy_t *energy, const uint16_t *index, int pitch,
+                                  const int *seam, int width, int height) {
+    const int maxDelta = energy_policy_t::maxDelta;
+
+    #pragma omp parallel for
+    for (int row = 0; row < height; row++) {
+        const uint16_t *indexRow = index + INDEX(row, 0, pitch);
+        energy_t *energyRow = energy + INDEX(row, 0, pitch);
+        int lowerBound = std::max(0, seam[row] - 2);
+        int upperBound = std::min(width - 1, seam[row] + 2);
+        for (int col = lowerBound; col <= upperBound; col++) {
+
+            // For simplicity, make all edges 1
+            if ((row == 0) || (row == (height - 1)) || (col == 0) || (col == (width - 1))) {
+                energyRow[indexRow[col]] = energyFromDelta<energy_t>(maxDelta, maxDelta);
+                continue;
+            }
+
+            pixel block[9];
+            gatherNeighborhood(pixels, index, pitch, row, col, block);
+            int delta = energy_policy_t::delta(block, 1, 1, 3);
+            energyRow[indexRow[col]] = energyFromDelta<energy_t>(delta, maxDelta);
+        }
+    }
+}
+
+
+// Copies the energy matrix into the ACM to start the ACM off. The integer
+// pipeline widens each value as it goes.
+template <typename energy_t, typename cost_t>
+void copyEnergyToACM(energy_t *energy, cost_t *acm, int count) {
+    #pragma omp parallel for
+    for (int i = 0; i < count; i++) {
+        acm[i] = (cost_t)energy[i];
+    }
+}
+
+template <typename cost_t>
+void copyEnergyToACM(cost_t *energy, cost_t *acm, int count) {
+    memcpy(acm, energy, sizeof(cost_t) * count);
+}
+
+
+// How generateSeam picks the root of each seam: the exact cheapest entry of
+// the ACM's last row, or the average of the bottom rows of a band-approximate
+// ACM (see sweepACMBands), one band per thread.
+enum SeamRoot { seamRootExact, seamRootBands, seamRootCount };
+
+static const char *seamRootNames[seamRootCount] = { "exact", "bands" };
+
+
+// How generateSeam traces a seam up from its root: by walking back up the
+// ACM (see seamStep), or by following the parents the ACM sweep noted in a
+// parent table (see acm_parents.h), which lets all but a few of the ACM's
+// rows share a ring.
+enum SeamBacktrack { seamBacktrackACM, seamBacktrackParents, seamBacktrackCount };
+
+static const char *seamBacktrackNames[seamBacktrackCount] = { "acm", "parents" };
+
+
+// The order carveImage2D takes vertical and horizontal seams out in: all
+// the vertical ones and then all the horizontal ones, one of each in turn,
+// or whichever of the two cheapest seams removes less energy each time.
+enum SeamOrder { seamOrderPhases, seamOrderAlternate, seamOrderGreedy, seamOrderCount };
+
+static const char *seamOrderNames[seamOrderCount] = { "phases", "alternate", "greedy" };
+
+
+// How to carve an image. Set from the command line in main.
+typedef struct
+{
+	int seamCount;
+
+	// How many horizontal seams carveImage2D takes out, and in which
+	// SeamOrder.
+	int horizontalSeamCount;
+	int seamOrder;
+
+	// Use the uint16_t energy / uint32_t ACM pipeline instead of doubles.
+	bool integerEnergy;
+
+	// Use floats instead of doubles (unless integerEnergy is set).
+	bool floatEnergy;
+
+	// Which EnergyFunction to carve with.
+	int energy;
+
+	// Pick seams by forward energy instead of the energy function.
+	bool forwardEnergy;
+
+	// Keep the ACM between seams and only recompute what changed.
+	bool incrementalACM;
+
+	// Which SeamRoot to pick seams by, and for seamRootBands, how many rows
+	// above its band each band starts from.
+	int seamRoot;
+	int haloRows;
+
+	// Which SeamBacktrack to trace seams with.
+	int backtrack;
+
+	// How many seams to take out of each ACM (see generateSeams). The
+	// incremental ACM always takes one.
+	int seamsPerPass;
+
+	// Find each seam on the image shrunk by 2^pyramidLevels and refine it in
+	// a band pyramidBand columns either side (see calculatePyramidACM), or
+	// 0 for the full ACM. Takes one seam at a time, without -incremental.
+	int pyramidLevels;
+	int pyramidBand;
+
+	// Take seams out of an index of each row rather than out of the pixels
+	// and the energy, and pack the rows once more than lazyCompact percent
+	// of each has gone (see carveImageWith). Backward energy and the full
+	// ACM only.
+	bool lazyRemoval;
+	int lazyCompact;
+} carve_options_t;
+
+
+// Timing breakdown of one carve, in seconds.
+typedef struct
+{
+	double acm;
+	double generate;
+	double remove;
+
+	// Total energy of the pixels removed, by the carve's energy function.
+	double seamEnergy;
+
+	// The share of ACM entries we computed, out of recomputing the whole
+	// ACM for every seam.
+	double acmFraction;
+
+	// How many ACMs we computed.
+	int acmPasses;
+
+	// Time carveImage2D spent turning the image around.
+	double transpose;
+
+	// Time enlargeImage spent widening the image.
+	double insert;
+} carve_stats_t;
+
+
+// Sums the energy of the pixels along a seam, in the same [0, 1] units
+// as the double pipeline, with the image's rows pitch apart. Used to
+// compare how much a carve removed.
+template <typename energy_policy_t>
+double seamEnergy(const pixel *pixels, const int *seam, int pitch, int height) {
+    const int maxDelta = energy_policy_t::maxDelta;
+
+    // Seams never touch the edge columns, but do run through the top and
+    // bottom rows.
+    uint64_t total = (height > 1) ? (2 * maxDelta) : maxDelta;
+    for (int row = 1; row < (height - 1); row++) {
+        total += energy_policy_t::delta(pixels, row, seam[row], pitch);
+    }
+    return ((double)total) / ((double)maxDelta);
+}
+
+
+// seamEnergy for a lazily carved image.
+template <typename energy_policy_t>
+double lazySeamEnergy(const pixel *pixels, const uint16_t *index, int pitch, const int *seam, int height) {
+    const int maxDelta = energy_policy_t::maxDelta;
+
+    uint64_t total = (height > 1) ? (2 * maxDelta) : maxDelta;
+    for (int row = 1; row < (height - 1); row++) {
+        pixel block[9];
+        gatherNeighborhood(pixels, index, pitch, row, seam[row], block);
+        total += energy_policy_t::delta(block, 1, 1, 3);
+    }
+    return ((double)total) / ((double)maxDelta);
+}
+
+
+// The seam loop for any energy function and either energy pipeline.
+// See carveImage.
+template <typename energy_policy_t, typename energy_t, typename cost_t>
+int carveImageWith(pixel *pixels, energy_t *energy, int width, int height,
+                   const carve_options_t &options, carve_stats_t *stats, uint16_t *removalOrder) {
+    using namespace std::chrono;
+    typedef std::chrono::high_resolution_clock Clock;
+    typedef std::chrono::duration<double> dsec;
+
+    int seamCount = std::max(0, std::min(options.seamCount, width - 3));
 
     int iterationWidth = width;
+    bool forward = options.forwardEnergy;
+
+    // Everything we carve keeps the rows pitch entries apart, from cache
+    // line to cache line (see rowPitch), however narrow the image gets, so
+    // taking a seam out of a row only moves the rest of that row. The
+    // pixels get copied into store for that, and back out at the end. Rows
+    // are handed out to threads the same way every time (static schedules
+    // over the rows), starting with the copy in, which is the first touch
+    // of each row, so on a NUMA machine a row's pages sit with the thread
+    // that works on it.
+    int pitch = rowPitch(width);
+    pixel *store = (pixel *)allocRows(sizeof(pixel) * pitch * height);
+    copyRows(pixels, width, store, pitch, width, height);
+
+    // Generate a general energy array, unless we were given one. Forward
+    // energy works from the pixels and doesn't need one.
+    bool haveEnergy = (energy != NULL);
+    energy_t *givenEnergy = energy;
+    energy = forward ? NULL : (energy_t *)allocRows(sizeof(energy_t) * pitch * height);
+    if (haveEnergy && !forward) {
+        copyRows(givenEnergy, width, energy, pitch, width, height);
+    }
+    free(givenEnergy);
+
+    // The ACM is a whole matrix with its rows pitch apart, since
+    // generateSeam walks the seam up it. One we keep between seams (the
+    // incremental ACM) only has to move what's right of the seam when it's
+    // taken out. The incremental ACM is always exact, so it always has one
+    // band.
+    bool incremental = options.incrementalACM;
+    bool pyramid = !incremental && (options.pyramidLevels > 0);
+    int bands = 1;
+    if (!incremental && !pyramid && (options.seamRoot == seamRootBands)) {
+        bands = std::max(1, std::min(omp_get_max_threads(), height));
+    }
 
-    // Generate a general energy array
-    double *energy = (double *)calloc(width * height, sizeof(double));
-    double *acm = (double *)calloc(width * height, sizeof(double));
+    // With -backtrack parents, the sweep notes every entry's parent and the
+    // seams are traced from those instead. Then unless the ACM is kept
+    // between seams, only the rows seamRootCosts reads need keeping, and
+    // the rest share a ring the sweep works in (see rollACMRows). Like the
+    // ACM's rows, the parent table's stay as wide as the image started.
+    bool parentTable = (options.backtrack == seamBacktrackParents);
+    int acmRows = (parentTable && !incremental) ? (ACM_RING_ROWS + bands) : height;
+    cost_t *acmMatrix = (cost_t *)allocRows(sizeof(cost_t) * pitch * acmRows);
+    memset(acmMatrix, 0, sizeof(cost_t) * pitch * acmRows);
+    cost_t **acm = (cost_t **)malloc(sizeof(cost_t *) * height);
+    if (acmRows == height) {
+        pointACMRows(acm, acmMatrix, height, pitch);
+    } else {
+        rollACMRows(acm, acmMatrix, acmMatrix + INDEX(ACM_RING_ROWS, 0, pitch), height, pitch, bands);
+    }
+    acm_parents_t parents = { NULL, 0 };
+    if (parentTable) {
+        parents = acm_parents_alloc(width, height);
+    }
+    acm_parents_t *acmParents = parentTable ? &parents : NULL;
 
-    // Generate a bool matrix for the seam. 
-    int *seam = (int *)calloc(height, sizeof(int));
+    // Generate a bool matrix for the seams. seam is the first one, which is
+    // the only one when we take a seam a pass.
+    int seamsPerPass = (incremental || pyramid) ? 1 : std::max(1, options.seamsPerPass);
+    int *seams = (int *)calloc((size_t)seamsPerPass * height, sizeof(int));
+    int *seam = seams;
+
+    acm_pyramid_t<cost_t> pyramidBuffers;
+    if (pyramid) {
+        acm_pyramid_alloc(&pyramidBuffers, options.pyramidLevels, options.pyramidBand, width, height, parentTable);
+    }
+
+    // Even in place, removing a seam still moves the rest of every row of
+    // the pixels and the energy. Lazy removal leaves them where they are
+    // and only takes the seam out of index, which lists each row's entries
+    // that are left: 2 bytes a pixel instead of the pixel and its energy.
+    // The ACM gathers its energy through the index. Once more than
+    // lazyCompact percent of what the rows held when they were last packed
+    // (packedWidth) is gone, they're packed again in place, so the gather
+    // doesn't pull in too many dead entries, and once more at the end.
+    // Forward energy, the incremental ACM and the pyramid read the pixels
+    // or the energy directly, so they stay eager.
+    bool lazy = options.lazyRemoval && !forward && !incremental && !pyramid && (width <= 65536);
+    int packedWidth = width;
+    uint16_t *index = NULL;
+    if (lazy) {
+        index = (uint16_t *)allocRows(sizeof(uint16_t) * pitch * height);
+        identityIndex(index, width, height, pitch);
+    }
 
-    // Allocate some space for a temporary image, necessary to remove each seam
-    pixel *temp_pixels = (pixel *)calloc(width * height, sizeof(pixel));
-    double *temp_energy = (double *)calloc(width * height, sizeof(double));
+    // To note which seam took out each pixel, we need to know which column
+    // of the original image each pixel came from, so those get removed
+    // from a matrix of their own alongside the pixels. Seam maps only go
+    // up to 65534 columns, so they fit in a uint16_t too.
+    uint16_t *columns = NULL;
+    if (removalOrder) {
+        columns = (uint16_t *)allocRows(sizeof(uint16_t) * pitch * height);
+        identityIndex(columns, width, height, pitch);
+        #pragma omp parallel for
+        for (int row = 0; row < height; row++) {
+            for (int col = 0; col < width; col++) {
+                removalOrder[INDEX(row, col, width)] = SEAM_MAP_KEPT;
+            }
+        }
+    }
 
     // Create some timing measures
     double acm_time = 0;
     double generate_time = 0;
     double remove_time = 0;
+    double seam_energy = 0;
+    long acm_entries = 0;
+    long acm_full_entries = 0;
+    int acm_passes = 0;
 
     // Let's generate the overall energy matrix first once
     // For this optimization, let's see what happens if we just 
     // calculate the overall energy once, use it, remove the seam
     // from the energy, and then just recalculate along the seam rather than the whole thing.
-    calculateEnergy(pixels, energy, iterationWidth, height);
-
-    for (int s = 0; s < SEAM_COUNT; s++) {
-
-      // Copy our energy matrix to our ACM matrix and compute the ACM
-      memcpy(acm, energy, sizeof(double) * iterationWidth * height);
-      auto acm_start = Clock::now();
-      // Now let's get the ACM of this array
-      calculateACM(acm, iterationWidth, height);
-      acm_time += duration_cast<dsec>(Clock::now() - acm_start).count();
-      
+    if (!forward && !haveEnergy) {
+        calculateEnergy<energy_policy_t>(store, energy, iterationWidth, height, pitch);
+    }
 
-      auto generate_start = Clock::now();
-      // Now that we have the ACM, let's generate the seam.
-      generateSeam(acm, seam, iterationWidth, height);
-      generate_time += duration_cast<dsec>(Clock::now() - generate_start).count();
-      
+    int found = 1;
+    for (int s = 0; s < seamCount; s += found) {
+
+        auto acm_start = Clock::now();
+        acm_passes++;
+        acm_full_entries += (long)iterationWidth * height;
+        int acmWidth = iterationWidth;
+        bool usePyramid = pyramid && pyramidFits(&pyramidBuffers, acmWidth, height);
+        if (usePyramid) {
+            acm_entries += calculatePyramidACM(&pyramidBuffers, store, energy, acm, acmParents, acmWidth, height,
+                                               pitch, forward);
+        } else if (incremental && (s > 0)) {
+            // Take the last seam out of the last ACM, then fix up the band
+            // under it. The seam is in the columns of the old width.
+            removeSeamFromACM(acm, acmParents, seam, acmWidth + 1, height);
+            if (forward) {
+                acm_entries += updateACMAlongSeam(acm, seam, acmWidth, height,
+                    [=](int row, int colLow, int colHigh) {
+                        if (row > 0) {
+                            calculateForwardACMSpan(store, acm, acmParents, pitch, row, colLow, colHigh);
+                        }
+                    });
+            } else {
+                pitched_energy_t<energy_t> pitchedEnergy = { energy, NULL, pitch };
+                acm_entries += updateACMAlongSeam(acm, seam, acmWidth, height,
+                    [=](int row, int colLow, int colHigh) {
+                        calculateACMSpanFromEnergy(pitchedEnergy, acm, acmParents, row, colLow, colHigh);
+                    });
+            }
+        } else if (forward) {
+            // The forward ACM comes straight from the pixels.
+            if (bands > 1) {
+                calculateForwardACMBands(store, acm, acmParents, acmWidth, height, pitch, bands, options.haloRows);
+            } else {
+                calculateForwardACM(store, acm, acmParents, acmWidth, height, pitch);
+            }
+            acm_entries += (long)acmWidth * height;
+        } else {
+            // The ACM copies in the energy as it goes.
+            pitched_energy_t<energy_t> pitchedEnergy = { energy, index, pitch };
+            if (bands > 1) {
+                calculateACMBands(pitchedEnergy, acm, acmParents, acmWidth, height, bands, options.haloRows);
+            } else {
+                calculateACM(pitchedEnergy, acm, acmParents, acmWidth, height);
+            }
+            acm_entries += (long)acmWidth * height;
+        }
+        acm_time += duration_cast<dsec>(Clock::now() - acm_start).count();
+
+
+        auto generate_start = Clock::now();
+        // Now that we have the ACM, let's generate the seams.
+        int count = std::min(seamsPerPass, seamCount - s);
+        const pixel *forwardPixels = forward ? store : NULL;
+        if (usePyramid) {
+            generatePyramidSeam(&pyramidBuffers, acm, acmParents, forwardPixels, pitch, seam, height);
+            found = 1;
+        } else if (count == 1) {
+            generateSeam(acm, acmParents, forwardPixels, pitch, seam, iterationWidth, height, bands);
+            found = 1;
+        } else {
+            found = generateSeams(acm, acmParents, forwardPixels, pitch, seams, count, iterationWidth, height,
+                                  bands);
+        }
+        generate_time += duration_cast<dsec>(Clock::now() - generate_start).count();
 
+        if (stats) {
+            for (int i = 0; i < found; i++) {
+                const int *seamI = seams + ((size_t)i * height);
+                seam_energy += lazy ? lazySeamEnergy<energy_policy_t>(store, index, pitch, seamI, height)
+                                    : seamEnergy<energy_policy_t>(store, seamI, pitch, height);
+            }
+        }
 
-      auto remove_start = Clock::now();
-      // Now that we have the seam, we should remove it from our image AND the energy matrix
-      removeSeam(pixels, temp_pixels, seam, iterationWidth, height);
-      removeSeamFromEnergy(energy, temp_energy, seam, iterationWidth, height);
-      remove_time += duration_cast<dsec>(Clock::now() - remove_start).count();
-      
-      // Now we should calculate the energy only along the seam
 
-      // Decrement our width, we have one less seam now
-      iterationWidth--;
+        auto remove_start = Clock::now();
+        // Note which seam took out each pixel first, while they're still
+        // in the index.
+        if (removalOrder) {
+            #pragma omp parallel for
+            for (int row = 0; row < height; row++) {
+                for (int i = 0; i < found; i++) {
+                    int seamCol = seams[((size_t)i * height) + row];
+                    int at = lazy ? index[INDEX(row, seamCol, pitch)] : seamCol;
+                    int col = columns[INDEX(row, at, pitch)];
+                    removalOrder[INDEX(row, col, width)] = (uint16_t)(s + i);
+                }
+            }
+        }
 
-      calculateEnergyAlongSeam(pixels, energy, seam, iterationWidth, height);
+        // Now that we have the seams, we should remove them from our image AND the energy matrix
+        if (lazy) {
+            removeSeamsFromIndex(index, pitch, seams, found, iterationWidth, height);
+            int left = iterationWidth - found;
+            if (((long)(packedWidth - left) * 100) > ((long)packedWidth * options.lazyCompact)) {
+                compactLazyRows(store, index, pitch, store, pitch, left, height);
+                compactLazyRows(energy, index, pitch, energy, pitch, left, height);
+                if (removalOrder) {
+                    compactLazyRows(columns, index, pitch, columns, pitch, left, height);
+                }
+                packedWidth = left;
+                identityIndex(index, left, height, pitch);
+            }
+        } else {
+            removeSeams(store, energy, columns, seams, found, iterationWidth, height, pitch);
+        }
+        remove_time += duration_cast<dsec>(Clock::now() - remove_start).count();
+
+        // Now we should calculate the energy only along the seams
+
+        // Decrement our width, we have fewer seams now
+        iterationWidth -= found;
+
+        // Seam i has i seams left of it in every row, so that's how far
+        // it moved over. The first stays put, and for one seam that's it.
+        if (!forward) {
+            for (int i = 0; i < found; i++) {
+                int *shifted = seams + ((size_t)i * height);
+                for (int row = 0; (i > 0) && (row < height); row++) {
+                    shifted[row] -= i;
+                }
+                if (lazy) {
+                    calculateLazyEnergyAlongSeam<energy_policy_t>(store, energy, index, pitch, shifted,
+                                                                  iterationWidth, height);
+                } else {
+                    calculateEnergyAlongSeam<energy_policy_t>(store, energy, shifted, iterationWidth, height,
+                                                              pitch);
+                }
+            }
+        }
 
     }
 
-    // Print our timing results
-    printf("ACM Time: %lf.\n", acm_time);
-    printf("Generate Time: %lf.\n", generate_time);
-    printf("Remove Time: %lf.\n", remove_time);
+    // The carved image goes back into pixels, packed, through the index if
+    // it's lazy.
+    auto remove_start = Clock::now();
+    if (lazy) {
+        compactLazyRows(store, index, pitch, pixels, iterationWidth, iterationWidth, height);
+    } else {
+        copyRows(store, pitch, pixels, iterationWidth, iterationWidth, height);
+    }
+    remove_time += duration_cast<dsec>(Clock::now() - remove_start).count();
+
+    if (stats) {
+        stats->acm = acm_time;
+        stats->generate = generate_time;
+        stats->remove = remove_time;
+        stats->seamEnergy = seam_energy;
+        stats->acmFraction = (acm_full_entries > 0) ? ((double)acm_entries / acm_full_entries) : 1.0;
+        stats->acmPasses = acm_passes;
+    }
 
     //Free all our memory
+    free(store);
     free(energy);
-    free(temp_energy);
     free(acm);
-    free(seam);
-    free(temp_pixels);
+    free(acmMatrix);
+    acm_parents_free(&parents);
+    free(seams);
+    free(columns);
+    free(index);
+    if (pyramid) {
+        acm_pyramid_free(&pyramidBuffers);
+    }
 
-  }
+    return iterationWidth;
+}
 
 
+// Picks the pipeline for an energy function. See carveImage.
+template <typename energy_policy_t>
+int carveImageWithPolicy(pixel *pixels, double *energy, int width, int height,
+                         const carve_options_t &options, carve_stats_t *stats, uint16_t *removalOrder) {
+    if (options.integerEnergy) {
+        // Recomputing integer energy costs the same as converting it.
+        free(energy);
+        return carveImageWith<energy_policy_t, uint16_t, uint32_t>(pixels, NULL, width, height, options, stats,
+                                                                   removalOrder);
+    }
+    if (options.floatEnergy) {
+        free(energy);
+        return carveImageWith<energy_policy_t, float, float>(pixels, NULL, width, height, options, stats,
+                                                             removalOrder);
+    }
+    return carveImageWith<energy_policy_t, double, double>(pixels, energy, width, height, options, stats,
+                                                           removalOrder);
+}
 
-  compute_time += duration_cast<dsec>(Clock::now() - compute_start).count();
-  printf("Computation Time: %lf.\n", compute_time);
 
-  int newWidth = width - SEAM_COUNT;
-  
+// Removes options.seamCount vertical seams from an image in place, leaving
+// the result packed at the front of pixels with the returned width. energy
+// is the image's horizontal energy matrix if we already have it (carveImage
+// takes it over and frees it), or NULL to compute it here. At most
+// width - 3 seams can be removed, since seams never touch the edge columns.
+// If removalOrder isn't NULL, it gets a width * height seam map of the
+// carve (see seammap.h and retargetImage).
+int carveImage(pixel *pixels, double *energy, int width, int height,
+               const carve_options_t &options, carve_stats_t *stats, uint16_t *removalOrder) {
+    if (options.energy != energyHorizontal) {
+        free(energy);
+        energy = NULL;
+    }
+
+    switch (options.energy) {
+        case energyDualGradient:
+            return carveImageWithPolicy<DualGradientEnergy>(pixels, energy, width, height, options, stats,
+                                                           removalOrder);
+        case energySobel:
+            return carveImageWithPolicy<SobelEnergy>(pixels, energy, width, height, options, stats,
+                                                           removalOrder);
+        case energyLuma:
+            return carveImageWithPolicy<LumaEnergy>(pixels, energy, width, height, options, stats,
+                                                           removalOrder);
+        default:
+            return carveImageWithPolicy<HorizontalEnergy>(pixels, energy, width, height, options, stats,
+                                                           removalOrder);
+    }
+}
+
+
+// Transposes a matrix height rows by width columns into out, which ends up
+// width rows by height columns. It goes a TRANSPOSE_BLOCK square at a time,
+// so both the rows it reads and the rows it writes stay in cache instead of
+// one side striding through memory a whole row per element.
+#define TRANSPOSE_BLOCK 32
+
+template <typename value_t>
+void transposeMatrix(const value_t *in, value_t *out, int width, int height) {
+    #pragma omp parallel for schedule(static)
+    for (int rowBlock = 0; rowBlock < height; rowBlock += TRANSPOSE_BLOCK) {
+        int rowEnd = std::min(rowBlock + TRANSPOSE_BLOCK, height);
+        for (int colBlock = 0; colBlock < width; colBlock += TRANSPOSE_BLOCK) {
+            int colEnd = std::min(colBlock + TRANSPOSE_BLOCK, width);
+            for (int row = rowBlock; row < rowEnd; row++) {
+                for (int col = colBlock; col < colEnd; col++) {
+                    out[INDEX(col, row, height)] = in[INDEX(row, col, width)];
+                }
+            }
+        }
+    }
+}
+
+
+// Removes options.seamCount vertical and options.horizontalSeamCount
+// horizontal seams, in options.seamOrder, leaving the result packed at the
+// front of pixels with the returned width and *newHeight. Horizontal seams
+// are vertical seams of the image turned on its side, so the image gets
+// transposed (see transposeMatrix) whenever we switch, and carveImage does
+// the rest in whichever layout we're in. The energy isn't transposed along
+// with it: horizontal energy on its side is a different energy, so each
+// carveImage recomputes it. energy is as for carveImage.
+//
+// Greedy carves a seam both ways from the same image and keeps whichever
+// removed less energy (by options.energy), so it does twice the work.
+int carveImage2D(pixel *pixels, double *energy, int width, int height,
+                 const carve_options_t &options, carve_stats_t *stats, int *newHeight) {
+    using namespace std::chrono;
+    typedef std::chrono::high_resolution_clock Clock;
+    typedef std::chrono::duration<double> dsec;
+
+    int verticalSeams = std::max(0, std::min(options.seamCount, width - 3));
+    int horizontalSeams = std::max(0, std::min(options.horizontalSeamCount, height - 3));
+    if (horizontalSeams == 0) {
+        *newHeight = height;
+        int newWidth = carveImage(pixels, energy, width, height, options, stats, NULL);
+        if (stats) {
+            stats->transpose = 0;
+        }
+        return newWidth;
+    }
+
+    // image is the image as it is now, transposed or not, and spare and
+    // trial are room to turn it around and to carve a greedy trial in.
+    pixel *spare = (pixel *)malloc(sizeof(pixel) * width * height);
+    pixel *trial = (pixel *)malloc(sizeof(pixel) * width * height);
+    pixel *image = pixels;
+    pixel *buffers[2] = { spare, trial };
+    bool transposed = false;
+    int iterationWidth = width;
+    int iterationHeight = height;
+
+    carve_stats_t total;
+    memset(&total, 0, sizeof(total));
+    double seams = 0;
+
+    // Gets the image into the layout for our next seams.
+    auto turn = [&](bool horizontal) {
+        if (horizontal == transposed) {
+            return;
+        }
+        auto transpose_start = Clock::now();
+        if (transposed) {
+            transposeMatrix(image, spare, iterationHeight, iterationWidth);
+        } else {
+            transposeMatrix(image, spare, iterationWidth, iterationHeight);
+        }
+        std::swap(image, spare);
+        transposed = horizontal;
+        total.transpose += duration_cast<dsec>(Clock::now() - transpose_start).count();
+    };
+
+    // Carves count seams one way out of buffer, which is in that layout,
+    // adding up the time it took. Returns the seams' energy. The seams
+    // count towards the ACM fraction, unless fraction isn't NULL (a greedy
+    // trial, which might not be kept), when it's just set to theirs.
+    auto carve = [&](pixel *buffer, bool horizontal, int count, double *fraction) {
+        carve_options_t runOptions = options;
+        runOptions.seamCount = count;
+        carve_stats_t runStats;
+        if (horizontal) {
+            carveImage(buffer, NULL, iterationHeight, iterationWidth, runOptions, &runStats, NULL);
+        } else {
+            // Only the untouched image has the energy we were given.
+            double *runEnergy = (iterationWidth == width && iterationHeight == height) ? energy : NULL;
+            if (runEnergy) {
+                energy = NULL;
+            }
+            carveImage(buffer, runEnergy, iterationWidth, iterationHeight, runOptions, &runStats, NULL);
+        }
+        total.acm += runStats.acm;
+        total.generate += runStats.generate;
+        total.remove += runStats.remove;
+        total.acmPasses += runStats.acmPasses;
+        if (fraction) {
+            *fraction = runStats.acmFraction;
+        } else {
+            total.acmFraction += runStats.acmFraction * count;
+            seams += count;
+        }
+        return runStats.seamEnergy;
+    };
+
+    // Carves count seams one way out of the image.
+    auto carveRun = [&](bool horizontal, int count) {
+        if (count == 0) {
+            return;
+        }
+        turn(horizontal);
+        total.seamEnergy += carve(image, horizontal, count, NULL);
+        if (horizontal) {
+            iterationHeight -= count;
+        } else {
+            iterationWidth -= count;
+        }
+    };
+
+    if (options.seamOrder == seamOrderAlternate) {
+        bool horizontal = false;
+        while ((verticalSeams > 0) || (horizontalSeams > 0)) {
+            if ((horizontal && (horizontalSeams > 0)) || (verticalSeams == 0)) {
+                carveRun(true, 1);
+                horizontalSeams--;
+            } else {
+                carveRun(false, 1);
+                verticalSeams--;
+            }
+            horizontal = !horizontal;
+        }
+    } else if (options.seamOrder == seamOrderGreedy) {
+        while ((verticalSeams > 0) && (horizontalSeams > 0)) {
+            // The image the right way round to carve a vertical seam out
+            // of in trial, and on its side to carve a horizontal one out of
+            // in spare. One's a copy and the other a transpose.
+            int size = iterationWidth * iterationHeight;
+            auto transpose_start = Clock::now();
+            if (transposed) {
+                memcpy(spare, image, sizeof(pixel) * size);
+                transposeMatrix(image, trial, iterationHeight, iterationWidth);
+            } else {
+                memcpy(trial, image, sizeof(pixel) * size);
+                transposeMatrix(image, spare, iterationWidth, iterationHeight);
+            }
+            total.transpose += duration_cast<dsec>(Clock::now() - transpose_start).count();
+
+            double verticalFraction, horizontalFraction;
+            double verticalEnergy = carve(trial, false, 1, &verticalFraction);
+            double horizontalEnergy = carve(spare, true, 1, &horizontalFraction);
+            seams++;
+            if (verticalEnergy <= horizontalEnergy) {
+                std::swap(image, trial);
+                transposed = false;
+                total.acmFraction += verticalFraction;
+                total.seamEnergy += verticalEnergy;
+                iterationWidth--;
+                verticalSeams--;
+            } else {
+                std::swap(image, spare);
+                transposed = true;
+                total.acmFraction += horizontalFraction;
+                total.seamEnergy += horizontalEnergy;
+                iterationHeight--;
+                horizontalSeams--;
+            }
+        }
+        carveRun(false, verticalSeams);
+        carveRun(true, horizontalSeams);
+    } else {
+        carveRun(false, verticalSeams);
+        carveRun(true, horizontalSeams);
+    }
+
+    // Back the right way round, and into pixels.
+    turn(false);
+    if (image != pixels) {
+        memcpy(pixels, image, sizeof(pixel) * iterationWidth * iterationHeight);
+    }
+    free(buffers[0]);
+    free(buffers[1]);
+    free(energy);
+
+    if (stats) {
+        *stats = total;
+        stats->acmFraction = (seams > 0) ? (total.acmFraction / seams) : 1.0;
+    }
+    *newHeight = iterationHeight;
+    return iterationWidth;
+}
+
+
+// Makes the image newWidth pixels wide from the original image and its seam
+// map, by keeping the pixels the first width - newWidth seams didn't take
+// out, in one pass over the image. That's exactly what carving it to
+// newWidth gives if the map was carved a seam a pass (-k 1), or newWidth
+// falls between passes. Within a pass of -k seams the orders go left to
+// right, not in the order a shorter pass would have picked them. Each row
+// builds a mask of the pixels it keeps, which vectorizes, and then packs
+// those down without branching.
+void retargetImage(const pixel *pixels, const uint16_t *removalOrder, pixel *output, int width, int height,
+                   int newWidth) {
+    uint16_t removed = (uint16_t)(width - newWidth);
+
+    #pragma omp parallel for
+    for (int row = 0; row < height; row++) {
+        const uint16_t *rowOrder = removalOrder + INDEX(row, 0, width);
+        const pixel *rowPixels = pixels + INDEX(row, 0, width);
+        uint8_t keep[width];
+        pixel rowOutput[width];
+
+        for (int col = 0; col < width; col++) {
+            keep[col] = (rowOrder[col] >= removed);
+        }
+
+        // Every pixel gets written, but only the ones we keep move us on.
+        int outCol = 0;
+        for (int col = 0; col < width; col++) {
+            rowOutput[outCol] = rowPixels[col];
+            outCol += keep[col];
+        }
+        memcpy(output + INDEX(row, 0, newWidth), rowOutput, sizeof(pixel) * newWidth);
+    }
+}
+
+
+// Widens an image by count pixels a row, from its seam map: every pixel
+// the first count seams would take out is written twice, the second time
+// blended with the pixel to its right (seams never reach the last column,
+// so there always is one). Each row is scattered out on its own.
+void insertSeams(const pixel *pixels, const uint16_t *removalOrder, pixel *output, int width, int height,
+                 int count) {
+    int newWidth = width + count;
+
+    #pragma omp parallel for
+    for (int row = 0; row < height; row++) {
+        const uint16_t *rowOrder = removalOrder + INDEX(row, 0, width);
+        const pixel *rowPixels = pixels + INDEX(row, 0, width);
+        pixel *rowOutput = output + INDEX(row, 0, newWidth);
+
+        int outCol = 0;
+        for (int col = 0; col < width; col++) {
+            rowOutput[outCol++] = rowPixels[col];
+            if (rowOrder[col] < count) {
+                const pixel &left = rowPixels[col];
+                const pixel &right = rowPixels[col + 1];
+                rowOutput[outCol].r = (uint8_t)((left.r + right.r + 1) / 2);
+                rowOutput[outCol].g = (uint8_t)((left.g + right.g + 1) / 2);
+                rowOutput[outCol].b = (uint8_t)((left.b + right.b + 1) / 2);
+                outCol++;
+            }
+        }
+    }
+}
+
+
+// The narrowest image enlargeImage can find seams in, and the widest it
+// can make one, since its seam maps have to fit the wider image.
+#define ENLARGE_MIN_WIDTH 4
+#define ENLARGE_MAX_WIDTH (SEAM_MAP_KEPT - 1)
+
+// Makes an image count pixels wider by seam insertion. We carve a copy of
+// the image to find the seams carveImage would take out first (noting
+// them in a seam map), then put all of them back in twice with one
+// insertSeams pass, rather than growing the image a seam at a time. Taking
+// more than half the image's seams would just stretch the same ones, so
+// bigger enlargements go in rounds of at most that.
+//
+// width has to be at least ENLARGE_MIN_WIDTH, and width + count at most
+// ENLARGE_MAX_WIDTH. Takes over pixels and returns the wider image,
+// *newWidth wide.
+pixel *enlargeImage(pixel *pixels, int width, int height, int count, const carve_options_t &options,
+                    carve_stats_t *stats, int *newWidth) {
+    using namespace std::chrono;
+    typedef std::chrono::high_resolution_clock Clock;
+    typedef std::chrono::duration<double> dsec;
+
+    carve_stats_t total;
+    memset(&total, 0, sizeof(total));
+    int iterationWidth = width;
+
+    while (count > 0) {
+        // Seam maps count seams in a uint16_t, which the caller has made
+        // sure the final width fits in.
+        int seams = std::min(count, std::max(1, std::min(iterationWidth / 2, iterationWidth - 3)));
+        assert((iterationWidth >= ENLARGE_MIN_WIDTH) && (iterationWidth + seams <= ENLARGE_MAX_WIDTH));
+
+        int size = iterationWidth * height;
+        pixel *copy = (pixel *)malloc(sizeof(pixel) * size);
+        uint16_t *removalOrder = (uint16_t *)malloc(sizeof(uint16_t) * size);
+        memcpy(copy, pixels, sizeof(pixel) * size);
+
+        carve_options_t runOptions = options;
+        runOptions.seamCount = seams;
+        carve_stats_t runStats;
+        carveImage(copy, NULL, iterationWidth, height, runOptions, &runStats, removalOrder);
+        total.acm += runStats.acm;
+        total.generate += runStats.generate;
+        total.remove += runStats.remove;
+        total.seamEnergy += runStats.seamEnergy;
+        total.acmPasses += runStats.acmPasses;
+
+        auto insert_start = Clock::now();
+        pixel *wider = (pixel *)malloc(sizeof(pixel) * (iterationWidth + seams) * height);
+        insertSeams(pixels, removalOrder, wider, iterationWidth, height, seams);
+        total.insert += duration_cast<dsec>(Clock::now() - insert_start).count();
+
+        free(copy);
+        free(removalOrder);
+        free(pixels);
+        pixels = wider;
+        iterationWidth += seams;
+        count -= seams;
+    }
+
+    if (stats) {
+        *stats = total;
+        stats->acmFraction = 1.0;
+    }
+    *newWidth = iterationWidth;
+    return pixels;
+}
+
+
+// Whether carveImage can use the energy matrix readImage computes while
+// decoding, which is always horizontal energy in doubles.
+inline bool carveUsesReadEnergy(const carve_options_t &options) {
+    return (options.energy == energyHorizontal) && !options.integerEnergy && !options.floatEnergy &&
+           !options.forwardEnergy;
+}
+
+
+// Sums the integer energy along a seam, with its rows pitch apart.
+uint64_t seamCost(uint16_t *energy, int *seam, int pitch, int height) {
+    uint64_t cost = 0;
+    for (int row = 0; row < height; row++) {
+        cost += energy[INDEX(row, seam[row], pitch)];
+    }
+    return cost;
+}
+
+
+// Carves a copy of the image with the double and the integer pipeline in
+// lockstep and checks they pick the same seams, reporting the time each
+// pipeline spent on its ACMs and seams.
+//
+// The integer ACM is exact, but the double one rounds a little differently
+// depending on the path taken, so two paths with exactly the same cost can
+// come out a bit apart in doubles. Where the pipelines disagree we check
+// whether both seams cost the same. If they do, it was a tie that the
+// double pipeline broke by rounding. Both seams are equally cheap, and we
+// carry on with the double pipeline's seam.
+template <typename energy_policy_t>
+void verifyIntegerPipelineWith(pixel *pixels, int width, int height, carve_options_t options) {
+    using namespace std::chrono;
+    typedef std::chrono::high_resolution_clock Clock;
+    typedef std::chrono::duration<double> dsec;
+
+    int seamCount = std::max(0, std::min(options.seamCount, width - 3));
+    int size = width * height;
+
+    pixel *image = (pixel *)malloc(sizeof(pixel) * size);
+    memcpy(image, pixels, sizeof(pixel) * size);
+
+    // Like carveImageWith, the rows stay width apart as seams come out.
+    double *energy = (double *)calloc(size, sizeof(double));
+    double *acmMatrix = (double *)calloc(size, sizeof(double));
+    uint16_t *intEnergy = (uint16_t *)calloc(size, sizeof(uint16_t));
+    uint32_t *intAcmMatrix = (uint32_t *)calloc(size, sizeof(uint32_t));
+    double *acm[height];
+    uint32_t *intAcm[height];
+    pointACMRows(acm, acmMatrix, height, width);
+    pointACMRows(intAcm, intAcmMatrix, height, width);
+    int *seam = (int *)calloc(height, sizeof(int));
+    int *intSeam = (int *)calloc(height, sizeof(int));
+
+    calculateEnergy<energy_policy_t>(image, energy, width, height, width);
+    calculateEnergy<energy_policy_t>(image, intEnergy, width, height, width);
+    pitched_energy_t<double> pitchedEnergy = { energy, NULL, width };
+    pitched_energy_t<uint16_t> pitchedIntEnergy = { intEnergy, NULL, width };
+
+    double double_time = 0;
+    double integer_time = 0;
+    int matches = 0;
+    int ties = 0;
+    int mismatches = 0;
+
+    int iterationWidth = width;
+    for (int s = 0; s < seamCount; s++) {
+        auto double_start = Clock::now();
+        calculateACM(pitchedEnergy, acm, (acm_parents_t *)NULL, iterationWidth, height);
+        generateSeam(acm, (const acm_parents_t *)NULL, (const pixel *)NULL, width, seam, iterationWidth, height, 1);
+        double_time += duration_cast<dsec>(Clock::now() - double_start).count();
+
+        auto integer_start = Clock::now();
+        calculateACM(pitchedIntEnergy, intAcm, (acm_parents_t *)NULL, iterationWidth, height);
+        generateSeam(intAcm, (const acm_parents_t *)NULL, (const pixel *)NULL, width, intSeam, iterationWidth,
+                     height, 1);
+        integer_time += duration_cast<dsec>(Clock::now() - integer_start).count();
+
+        if (memcmp(seam, intSeam, sizeof(int) * height) == 0) {
+            matches++;
+        } else if (seamCost(intEnergy, seam, width, height) == seamCost(intEnergy, intSeam, width, height)) {
+            ties++;
+        } else {
+            mismatches++;
+        }
+
+        // Both pipelines carry on from the double pipeline's seam.
+        removeSeams(image, energy, intEnergy, seam, 1, iterationWidth, height, width);
+        iterationWidth--;
+        calculateEnergyAlongSeam<energy_policy_t>(image, energy, seam, iterationWidth, height, width);
+        calculateEnergyAlongSeam<energy_policy_t>(image, intEnergy, seam, iterationWidth, height, width);
+    }
+
+    printf("Double ACM + Generate Time: %lf.\n", double_time);
+    printf("Integer ACM + Generate Time: %lf.\n", integer_time);
+    printf("Integer pipeline: %d of %d seams identical, %d equal-cost ties, %d mismatches.\n",
+           matches, seamCount, ties, mismatches);
+
+    free(image);
+    free(energy);
+    free(acmMatrix);
+    free(intEnergy);
+    free(intAcmMatrix);
+    free(seam);
+    free(intSeam);
+}
+
+void verifyIntegerPipeline(pixel *pixels, int width, int height, carve_options_t options) {
+    switch (options.energy) {
+        case energyDualGradient:
+            verifyIntegerPipelineWith<DualGradientEnergy>(pixels, width, height, options);
+            break;
+        case energySobel:
+            verifyIntegerPipelineWith<SobelEnergy>(pixels, width, height, options);
+            break;
+        case energyLuma:
+            verifyIntegerPipelineWith<LumaEnergy>(pixels, width, height, options);
+            break;
+        default:
+            verifyIntegerPipelineWith<HorizontalEnergy>(pixels, width, height, options);
+            break;
+    }
+}
+
+
+// Times every energy kernel this CPU can run over the whole image and
+// checks each one gives exactly the same deltas as the scalar kernel.
+// Used by -energybench to see what the SIMD kernels buy us.
+void benchmarkEnergyKernels(pixel *pixels, int width, int height) {
+    using namespace std::chrono;
+    typedef std::chrono::high_resolution_clock Clock;
+    typedef std::chrono::duration<double> dsec;
+
+    const int repetitions = 20;
+    int size = width * height;
+
+    uint16_t *reference = (uint16_t *)calloc(size, sizeof(uint16_t));
+    uint16_t *delta = (uint16_t *)calloc(size, sizeof(uint16_t));
+
+    for (int row = 0; row < height; row++) {
+        const uint8_t *here = (const uint8_t *)(pixels + INDEX(row, 0, width));
+        energyDeltasScalar(here + 3, here - 3, reference + INDEX(row, 0, width), width);
+    }
+
+    for (int kernel = 0; kernel < energyKernelCount; kernel++) {
+        if (!energyKernelAvailable(kernel)) {
+            printf("Energy kernel %s: not supported on this CPU.\n", energyKernelNames[kernel]);
+            continue;
+        }
+
+        energy_kernel_t function = energyKernelFunction(kernel);
+        memset(delta, 0, sizeof(uint16_t) * size);
+
+        auto start = Clock::now();
+        for (int repetition = 0; repetition < repetitions; repetition++) {
+            #pragma omp parallel for
+            for (int row = 0; row < height; row++) {
+                const uint8_t *here = (const uint8_t *)(pixels + INDEX(row, 0, width));
+                function(here + 3, here - 3, delta + INDEX(row, 0, width), width);
+            }
+        }
+        double time = duration_cast<dsec>(Clock::now() - start).count() / repetitions;
+
+        bool matches = (memcmp(delta, reference, sizeof(uint16_t) * size) == 0);
+        printf("Energy kernel %s: %lf (%.1lf Mpixel/s), %s scalar.\n", energyKernelNames[kernel],
+               time, (size / time) / 1e6, matches ? "matches" : "DIFFERS FROM");
+    }
+
+    free(reference);
+    free(delta);
+}
+
+
+// Whether two ACMs (width entries a row) are the same.
+template <typename cost_t>
+bool sameACM(cost_t **a, cost_t **b, int width, int height) {
+    for (int row = 0; row < height; row++) {
+        if (memcmp(a[row], b[row], sizeof(cost_t) * width) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Whether two parent tables of ACMs height rows high are the same.
+bool sameParents(const acm_parents_t *a, const acm_parents_t *b, int height) {
+    return memcmp(a->words, b->words, sizeof(uint64_t) * a->rowWords * height) == 0;
+}
+
+
+// Checks the parallel ACM sweep gives exactly the same ACM and parents as
+// one thread sweeping the rows in order, for the backward ACM in both
+// pipelines and the forward one, at a range of thread counts, and that
+// bands whose halo reaches the top of the image do too. Also checks the
+// seam traced from the parents with the ACM in a ring of rows is the one
+// walking back up the whole ACM finds. Reports the time each took.
+void verifyParallelACM(pixel *pixels, int width, int height) {
+    using namespace std::chrono;
+    typedef std::chrono::high_resolution_clock Clock;
+    typedef std::chrono::duration<double> dsec;
+
+    int size = width * height;
+    double *energy = (double *)calloc(size, sizeof(double));
+    uint16_t *intEnergy = (uint16_t *)calloc(size, sizeof(uint16_t));
+    double *referenceMatrix = (double *)calloc(size, sizeof(double));
+    double *acmMatrix = (double *)calloc(size, sizeof(double));
+    uint32_t *intReferenceMatrix = (uint32_t *)calloc(size, sizeof(uint32_t));
+    uint32_t *intAcmMatrix = (uint32_t *)calloc(size, sizeof(uint32_t));
+    double *forwardReferenceMatrix = (double *)calloc(size, sizeof(double));
+    double *forwardAcmMatrix = (double *)calloc(size, sizeof(double));
+
+    double *reference[height];
+    double *acm[height];
+    uint32_t *intReference[height];
+    uint32_t *intAcm[height];
+    double *forwardReference[height];
+    double *forwardAcm[height];
+    pointACMRows(reference, referenceMatrix, height, width);
+    pointACMRows(acm, acmMatrix, height, width);
+    pointACMRows(intReference, intReferenceMatrix, height, width);
+    pointACMRows(intAcm, intAcmMatrix, height, width);
+    pointACMRows(forwardReference, forwardReferenceMatrix, height, width);
+    pointACMRows(forwardAcm, forwardAcmMatrix, height, width);
+
+    acm_parents_t referenceParents = acm_parents_alloc(width, height);
+    acm_parents_t parents = acm_parents_alloc(width, height);
+    acm_parents_t intReferenceParents = acm_parents_alloc(width, height);
+    acm_parents_t intParents = acm_parents_alloc(width, height);
+    acm_parents_t forwardReferenceParents = acm_parents_alloc(width, height);
+    acm_parents_t forwardParents = acm_parents_alloc(width, height);
+
+    calculateEnergy<HorizontalEnergy>(pixels, energy, width, height, width);
+    calculateEnergy<HorizontalEnergy>(pixels, intEnergy, width, height, width);
+    pitched_energy_t<double> pitchedEnergy = { energy, NULL, width };
+    pitched_energy_t<uint16_t> pitchedIntEnergy = { intEnergy, NULL, width };
+
+    // The sequential ACMs, one row at a time.
+    int threads = omp_get_max_threads();
+    omp_set_num_threads(1);
+    auto sequential_start = Clock::now();
+    calculateACM(pitchedEnergy, reference, (acm_parents_t *)NULL, width, height);
+    double sequential_time = duration_cast<dsec>(Clock::now() - sequential_start).count();
+    calculateACM(pitchedEnergy, reference, &referenceParents, width, height);
+    calculateACM(pitchedIntEnergy, intReference, &intReferenceParents, width, height);
+    calculateForwardACM(pixels, forwardReference, &forwardReferenceParents, width, height, width);
+    printf("Sequential ACM: %lf.\n", sequential_time);
+
+    // The seams walking back up the whole ACMs finds.
+    int seam[height];
+    int forwardSeam[height];
+    int ringSeam[height];
+    generateSeam(reference, (const acm_parents_t *)NULL, (const pixel *)NULL, width, seam, width, height, 1);
+    generateSeam(forwardReference, (const acm_parents_t *)NULL, pixels, width, forwardSeam, width, height, 1);
+    double *ring = (double *)calloc((size_t)width * (ACM_RING_ROWS + 1), sizeof(double));
+    double *ringAcm[height];
+    rollACMRows(ringAcm, ring, ring + INDEX(ACM_RING_ROWS, 0, width), height, width, 1);
+
+    const int threadCounts[] = { 2, 3, 4, 8, 16, 17, 32, 64 };
+    for (unsigned t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) {
+        omp_set_num_threads(threadCounts[t]);
+
+        auto parallel_start = Clock::now();
+        calculateACM(pitchedEnergy, acm, (acm_parents_t *)NULL, width, height);
+        double parallel_time = duration_cast<dsec>(Clock::now() - parallel_start).count();
+        bool matches = sameACM(acm, reference, width, height);
+
+        calculateACM(pitchedEnergy, acm, &parents, width, height);
+        calculateACM(pitchedIntEnergy, intAcm, &intParents, width, height);
+        calculateForwardACM(pixels, forwardAcm, &forwardParents, width, height, width);
+
+        matches = matches && sameACM(acm, reference, width, height) &&
+                  sameParents(&parents, &referenceParents, height) &&
+                  sameACM(intAcm, intReference, width, height) &&
+                  sameParents(&intParents, &intReferenceParents, height) &&
+                  sameACM(forwardAcm, forwardReference, width, height) &&
+                  sameParents(&forwardParents, &forwardReferenceParents, height);
+
+        // The ring of rows carving with -backtrack parents keeps.
+        calculateACM(pitchedEnergy, ringAcm, &parents, width, height);
+        generateSeam(ringAcm, &parents, (const pixel *)NULL, width, ringSeam, width, height, 1);
+        matches = matches && (memcmp(seam, ringSeam, sizeof(int) * height) == 0);
+        calculateForwardACM(pixels, ringAcm, &parents, width, height, width);
+        generateSeam(ringAcm, &parents, (const pixel *)NULL, width, ringSeam, width, height, 1);
+        matches = matches && (memcmp(forwardSeam, ringSeam, sizeof(int) * height) == 0);
+
+        // Bands whose halo reaches the top of the image are exact.
+        int bands = std::min(threadCounts[t], height);
+        calculateACMBands(pitchedEnergy, acm, (acm_parents_t *)NULL, width, height, bands, height);
+        matches = matches && sameACM(acm, reference, width, height);
+        calculateACMBands(pitchedEnergy, acm, &parents, width, height, bands, height);
+        matches = matches && sameParents(&parents, &referenceParents, height);
+
+        printf("Parallel ACM, %d threads: %lf, %s.\n", threadCounts[t], parallel_time,
+               matches ? "matches sequential" : "DIFFERS FROM SEQUENTIAL");
+    }
+    omp_set_num_threads(threads);
+
+    free(energy);
+    free(intEnergy);
+    free(referenceMatrix);
+    free(acmMatrix);
+    free(intReferenceMatrix);
+    free(intAcmMatrix);
+    free(forwardReferenceMatrix);
+    free(forwardAcmMatrix);
+    free(ring);
+    acm_parents_free(&referenceParents);
+    acm_parents_free(&parents);
+    acm_parents_free(&intReferenceParents);
+    acm_parents_free(&intParents);
+    acm_parents_free(&forwardReferenceParents);
+    acm_parents_free(&forwardParents);
+}
+
+
+// The ACM loop we used before the SIMD kernels, which copies the row above
+// into a buffer with sentinels at the ends first. Kept as a baseline for
+// benchmarkACMKernels.
+template <typename cost_t>
+void calculateACMRowAboveCopy(cost_t *acm, int width, int height) {
+    for (int row = 2; row < height; row++) {
+        cost_t rowAbove[width];
+        rowAbove[0] = maxCost<cost_t>();
+        for (int col = 1; col < (width - 1); col++) {
+            rowAbove[col] = acm[INDEX(row-1, col, width)];
+        }
+        rowAbove[(width-1)] = maxCost<cost_t>();
+
+        for (int col = 1; col < (width - 1); col++) {
+            cost_t upLeft = rowAbove[col-1];
+            cost_t up = rowAbove[col];
+            cost_t upRight = rowAbove[col+1];
+
+            acm[INDEX(row, col, width)] = acm[INDEX(row, col, width)] + min(upLeft, up, upRight);
+        }
+    }
+}
+
+
+// Times one thread computing the whole ACM of an image with the old
+// rowAbove copy loop and with each ACM kernel, and checks each kernel's
+// interior matches the old loop's exactly.
+template <typename energy_t, typename cost_t>
+void benchmarkACMKernelsWith(pixel *pixels, int width, int height, const char *typeName) {
+    using namespace std::chrono;
+    typedef std::chrono::high_resolution_clock Clock;
+    typedef std::chrono::duration<double> dsec;
+
+    const int repetitions = 20;
+    int size = width * height;
+    double cells = (double)(width - 2) * (height - 2);
+
+    energy_t *energy = (energy_t *)calloc(size, sizeof(energy_t));
+    cost_t *reference = (cost_t *)calloc(size, sizeof(cost_t));
+    cost_t *acm = (cost_t *)calloc(size, sizeof(cost_t));
+    calculateEnergy<HorizontalEnergy>(pixels, energy, width, height, width);
+
+    double time = 0;
+    for (int repetition = 0; repetition < repetitions; repetition++) {
+        copyEnergyToACM(energy, reference, size);
+        auto start = Clock::now();
+        calculateACMRowAboveCopy(reference, width, height);
+        time += duration_cast<dsec>(Clock::now() - start).count();
+    }
+    time /= repetitions;
+    printf("ACM %s rowAbove loop: %lf (%.1lf Mcell/s).\n", typeName, time, (cells / time) / 1e6);
+
+    for (int kernel = 0; kernel < acmKernelCount; kernel++) {
+        if (!acmKernelAvailable(kernel)) {
+            printf("ACM %s kernel %s: not supported on this CPU.\n", typeName, acmKernelNames[kernel]);
+            continue;
+        }
+        acm_kernel_t<cost_t> function = acmKernelFunction<cost_t>(kernel);
+        cost_t *acmRows[height];
+        pointACMRows(acmRows, acm, height, width);
+
+        time = 0;
+        for (int repetition = 0; repetition < repetitions; repetition++) {
+            copyEnergyToACM(energy, acm, size);
+            setACMEdgeColumns(acmRows, width, height, maxCost<cost_t>());
+            auto start = Clock::now();
+            for (int row = 2; row < height; row++) {
+                function(acm + INDEX(row-1, 0, width), acm + INDEX(row, 0, width), 1, width - 1);
+            }
+            time += duration_cast<dsec>(Clock::now() - start).count();
+        }
+        time /= repetitions;
+
+        // The edge columns differ (sentinels here), so compare the rest.
+        bool matches = true;
+        for (int row = 0; row < height; row++) {
+            matches = matches && (memcmp(acm + INDEX(row, 1, width), reference + INDEX(row, 1, width),
+                                         sizeof(cost_t) * (width - 2)) == 0);
+        }
+        printf("ACM %s kernel %s: %lf (%.1lf Mcell/s), %s the rowAbove loop.\n", typeName,
+               acmKernelNames[kernel], time, (cells / time) / 1e6, matches ? "matches" : "DIFFERS FROM");
+    }
+
+    // The same again noting each entry's parent, as -backtrack parents
+    // does, checked against the costs above and the scalar directions.
+    uint8_t *directions = (uint8_t *)malloc(width);
+    uint8_t *referenceDirections = (uint8_t *)malloc(width);
+    for (int kernel = 0; kernel < acmKernelCount; kernel++) {
+        if (!acmKernelAvailable(kernel)) {
+            continue;
+        }
+        acm_parent_kernel_t<cost_t> function = acmParentKernelFunction<cost_t>(kernel);
+        cost_t *acmRows[height];
+        pointACMRows(acmRows, acm, height, width);
+
+        time = 0;
+        for (int repetition = 0; repetition < repetitions; repetition++) {
+            copyEnergyToACM(energy, acm, size);
+            setACMEdgeColumns(acmRows, width, height, maxCost<cost_t>());
+            auto start = Clock::now();
+            for (int row = 2; row < height; row++) {
+                function(acm + INDEX(row-1, 0, width), acm + INDEX(row, 0, width), directions, 1, width - 1);
+            }
+            time += duration_cast<dsec>(Clock::now() - start).count();
+        }
+        time /= repetitions;
+
+        bool matches = true;
+        for (int row = 0; row < height; row++) {
+            matches = matches && (memcmp(acm + INDEX(row, 1, width), reference + INDEX(row, 1, width),
+                                         sizeof(cost_t) * (width - 2)) == 0);
+        }
+
+        // Recompute the last row from the finished row above it, with this
+        // kernel and the scalar one, to compare their directions.
+        copyEnergyToACM(energy + INDEX(height-1, 0, width), acm + INDEX(height-1, 0, width), width);
+        function(acm + INDEX(height-2, 0, width), acm + INDEX(height-1, 0, width), directions, 1, width - 1);
+        copyEnergyToACM(energy + INDEX(height-1, 0, width), acm + INDEX(height-1, 0, width), width);
+        acmRowParentsScalar<cost_t>(acm + INDEX(height-2, 0, width), acm + INDEX(height-1, 0, width),
+                                    referenceDirections, 1, width - 1);
+        matches = matches && (memcmp(directions, referenceDirections, width - 2) == 0);
+
+        printf("ACM %s kernel %s with parents: %lf (%.1lf Mcell/s), %s the rowAbove loop.\n", typeName,
+               acmKernelNames[kernel], time, (cells / time) / 1e6, matches ? "matches" : "DIFFERS FROM");
+    }
+    free(directions);
+    free(referenceDirections);
+
+    free(energy);
+    free(reference);
+    free(acm);
+}
+
+
+void benchmarkACMKernels(pixel *pixels, int width, int height) {
+    benchmarkACMKernelsWith<double, double>(pixels, width, height, "double");
+    benchmarkACMKernelsWith<float, float>(pixels, width, height, "float");
+    benchmarkACMKernelsWith<uint16_t, uint32_t>(pixels, width, height, "uint32");
+}
+
+
+// Carves copies of the image with exact seam roots and with the
+// band-approximate ACM at a few halos, with the rest of options as given,
+// and compares how long the ACMs took and how much energy the removed
+// seams had. The exact seams remove the least energy a seam at a time, so
+// the bands' extra energy is what the approximation costs.
+void benchmarkSeamRoots(pixel *pixels, int width, int height, carve_options_t options) {
+    const int halos[] = { 0, 8, 32, 128 };
+    int configs = 1 + (int)(sizeof(halos) / sizeof(halos[0]));
+    pixel *copy = (pixel *)malloc(sizeof(pixel) * width * height);
+    options.incrementalACM = false;
+
+    double exactEnergy = 0;
+    double exactTime = 0;
+    for (int config = 0; config < configs; config++) {
+        options.seamRoot = (config == 0) ? seamRootExact : seamRootBands;
+        options.haloRows = (config == 0) ? 0 : halos[config - 1];
+
+        carve_stats_t stats;
+        memcpy(copy, pixels, sizeof(pixel) * width * height);
+        carveImage(copy, NULL, width, height, options, &stats, NULL);
+        if (config == 0) {
+            exactEnergy = stats.seamEnergy;
+            exactTime = stats.acm;
+            printf("Seam roots exact: ACM %lf, removed energy %lf.\n", stats.acm, stats.seamEnergy);
+        } else {
+            printf("Seam roots bands, halo %d: ACM %lf (%.2lfx exact), removed energy %lf (%+.3lf%%).\n",
+                   options.haloRows, stats.acm, stats.acm / exactTime, stats.seamEnergy,
+                   100.0 * (stats.seamEnergy - exactEnergy) / exactEnergy);
+        }
+    }
+
+    free(copy);
+}
+
+
+// Carves copies of the image with the full ACM and with the pyramid (see
+// calculatePyramidACM) at 1 and 2 levels and a few bands, with the rest of
+// options as given, and compares how long the ACMs took and how much energy
+// the removed seams had. The full ACM removes the least a seam at a time.
+void benchmarkPyramid(pixel *pixels, int width, int height, carve_options_t options) {
+    const int levels[] = { 0, 1, 1, 1, 2, 2, 2 };
+    const int bands[] = { 0, 4, 8, 16, 4, 8, 16 };
+    pixel *copy = (pixel *)malloc(sizeof(pixel) * width * height);
+    options.incrementalACM = false;
+    options.seamsPerPass = 1;
+
+    double exactEnergy = 0;
+    double exactTime = 0;
+    for (unsigned config = 0; config < sizeof(levels) / sizeof(levels[0]); config++) {
+        options.pyramidLevels = levels[config];
+        options.pyramidBand = bands[config];
+
+        carve_stats_t stats;
+        memcpy(copy, pixels, sizeof(pixel) * width * height);
+        carveImage(copy, NULL, width, height, options, &stats, NULL);
+        if (config == 0) {
+            exactEnergy = stats.seamEnergy;
+            exactTime = stats.acm;
+            printf("Full ACM: ACM %lf, removed energy %lf.\n", stats.acm, stats.seamEnergy);
+        } else {
+            printf("Pyramid %dx, band %d: ACM %lf (%.2lfx faster), removed energy %lf (%+.3lf%%).\n",
+                   1 << levels[config], bands[config], stats.acm, exactTime / stats.acm, stats.seamEnergy,
+                   100.0 * (stats.seamEnergy - exactEnergy) / exactEnergy);
+        }
+    }
+
+    free(copy);
+}
+
+
+// Carves copies of the image removing seams from the pixels and the energy
+// every time, and lazily (see carveImageWith) packing the rows at a few
+// -compact percentages, with the rest of options as given. Compares the
+// remove and ACM times, since the ACM gathers through the index, and checks
+// the lazy carves come out the same.
+void benchmarkLazyRemoval(pixel *pixels, int width, int height, carve_options_t options) {
+    const int compact[] = { -1, 10, 25, 50, 100 };
+    pixel *eager = (pixel *)malloc(sizeof(pixel) * width * height);
+    pixel *copy = (pixel *)malloc(sizeof(pixel) * width * height);
+    options.forwardEnergy = false;
+    options.incrementalACM = false;
+    options.pyramidLevels = 0;
+
+    double eagerRemove = 0;
+    double eagerACM = 0;
+    int newWidth = width;
+    for (unsigned config = 0; config < sizeof(compact) / sizeof(compact[0]); config++) {
+        options.lazyRemoval = (compact[config] >= 0);
+        options.lazyCompact = compact[config];
+
+        carve_stats_t stats;
+        pixel *carved = options.lazyRemoval ? copy : eager;
+        memcpy(carved, pixels, sizeof(pixel) * width * height);
+        newWidth = carveImage(carved, NULL, width, height, options, &stats, NULL);
+        if (!options.lazyRemoval) {
+            eagerRemove = stats.remove;
+            eagerACM = stats.acm;
+            printf("Eager: remove %lf, ACM %lf.\n", stats.remove, stats.acm);
+        } else {
+            bool same = (memcmp(copy, eager, sizeof(pixel) * newWidth * height) == 0);
+            printf("Lazy, compact at %d%%: remove %lf (%.2lfx faster), ACM %lf (%.2lfx), %s.\n",
+                   compact[config], stats.remove, eagerRemove / stats.remove, stats.acm, stats.acm / eagerACM,
+                   same ? "same pixels" : "DIFFERENT pixels");
+        }
+    }
+
+    free(eager);
+    free(copy);
+}
+
+
+// Carves copies of the image taking 1 to 64 seams out of each ACM, with the
+// rest of options as given, and compares the time and the energy of the
+// removed seams against one seam a pass, which removes the least.
+void benchmarkSeamsPerPass(pixel *pixels, int width, int height, carve_options_t options) {
+    using namespace std::chrono;
+    typedef std::chrono::high_resolution_clock Clock;
+    typedef std::chrono::duration<double> dsec;
+
+    const int seamsPerPass[] = { 1, 2, 4, 8, 16, 32, 64 };
+    pixel *copy = (pixel *)malloc(sizeof(pixel) * width * height);
+    options.incrementalACM = false;
+
+    double singleEnergy = 0;
+    double singleTime = 0;
+    for (unsigned k = 0; k < sizeof(seamsPerPass) / sizeof(seamsPerPass[0]); k++) {
+        options.seamsPerPass = seamsPerPass[k];
+
+        carve_stats_t stats;
+        memcpy(copy, pixels, sizeof(pixel) * width * height);
+        auto start = Clock::now();
+        carveImage(copy, NULL, width, height, options, &stats, NULL);
+        double time = duration_cast<dsec>(Clock::now() - start).count();
+        if (k == 0) {
+            singleEnergy = stats.seamEnergy;
+            singleTime = time;
+        }
+        printf("Seams per pass %d: %d ACMs, %lf (%.2lfx one a pass), removed energy %lf (%+.3lf%%).\n",
+               seamsPerPass[k], stats.acmPasses, time, time / singleTime, stats.seamEnergy,
+               100.0 * (stats.seamEnergy - singleEnergy) / singleEnergy);
+    }
+
+    free(copy);
+}
+
+
+// Average time to compute the whole energy matrix with one energy function.
+template <typename energy_policy_t>
+double timeEnergyFunction(pixel *pixels, double *energy, int width, int height, int repetitions) {
+    using namespace std::chrono;
+    typedef std::chrono::high_resolution_clock Clock;
+    typedef std::chrono::duration<double> dsec;
+
+    auto start = Clock::now();
+    for (int repetition = 0; repetition < repetitions; repetition++) {
+        calculateEnergy<energy_policy_t>(pixels, energy, width, height, width);
+    }
+    return duration_cast<dsec>(Clock::now() - start).count() / repetitions;
+}
+
+
+// Times computing the energy matrix with every energy function, for
+// picking one with -energy.
+void benchmarkEnergyFunctions(pixel *pixels, int width, int height) {
+    const int repetitions = 20;
+    int size = width * height;
+    double *energy = (double *)calloc(size, sizeof(double));
+
+    for (int function = 0; function < energyFunctionCount; function++) {
+        double time;
+        switch (function) {
+            case energyDualGradient:
+                time = timeEnergyFunction<DualGradientEnergy>(pixels, energy, width, height, repetitions);
+                break;
+            case energySobel:
+                time = timeEnergyFunction<SobelEnergy>(pixels, energy, width, height, repetitions);
+                break;
+            case energyLuma:
+                time = timeEnergyFunction<LumaEnergy>(pixels, energy, width, height, repetitions);
+                break;
+            default:
+                time = timeEnergyFunction<HorizontalEnergy>(pixels, energy, width, height, repetitions);
+                break;
+        }
+        printf("Energy function %s: %lf (%.1lf Mpixel/s).\n", energyFunctionNames[function],
+               time, (size / time) / 1e6);
+    }
+
+    free(energy);
+}
+
+
+
+
+
+// Returns true if filename ends in the given extension, ignoring case.
+bool hasExtension(const char *filename, const char *extension) {
+    size_t nameLength = strlen(filename);
+    size_t extensionLength = strlen(extension);
+    if (nameLength < extensionLength) {
+        return false;
+    }
+    return strcasecmp(filename + nameLength - extensionLength, extension) == 0;
+}
+
+
+// Reads an image in our image_rgb.txt text format into a newly
+// allocated pixel array. The first line is the dimensions, the rest
+// is one "r g b" line per pixel. The file is parsed in parallel across
+// our OpenMP threads (see textimage.h).
+pixel *readImageText(const char *filename, int *width, int *height) {
+    using namespace std::chrono;
+    typedef std::chrono::high_resolution_clock Clock;
+    typedef std::chrono::duration<double> dsec;
+
+    auto parse_start = Clock::now();
+    size_t fileBytes = 0;
+    pixel *pixels = (pixel *)text_image_read(filename, width, height, &fileBytes);
+    double parse_time = duration_cast<dsec>(Clock::now() - parse_start).count();
+
+    if (pixels) {
+        printf("Parse Time: %lf (%.1lf MB/s).\n", parse_time, (fileBytes / parse_time) / 1e6);
+    }
+    return pixels;
+}
+
+
+// Writes an image out in the same text format readImageText reads.
+// Rows are formatted in parallel into a large buffer and written out
+// with a few big writes (see textimage.h).
+bool writeImageText(const char *filename, pixel *pixels, int width, int height) {
+    return text_image_write(filename, (uint8_t *)pixels, width, height);
+}
+
+
+#ifdef USE_LIBPNG
+// Shared state for computing the energy of a PNG while it's still being
+// decoded. The decoding thread publishes how many rows are done, and
+// threads claim the next row once its 3 row window has arrived.
+enum StreamState { streamWaiting, streamStarted, streamFailed };
+
+typedef struct
+{
+	pixel *pixels;
+	double *energy;
+	int width;
+	int height;
+
+	// With one thread, the decoder computes energy itself between rows.
+	bool decoderComputesEnergy;
+
+	std::atomic<int> state;
+	std::atomic<int> rowsDecoded;
+	std::atomic<int> nextRow;
+} energy_stream_t;
+
+
+// Computes the energy of every row whose window has been decoded and that
+// nobody else has claimed yet. If blocking, waits for more rows until the
+// whole image is done (or decoding fails), otherwise returns as soon as
+// the next row isn't ready.
+void drainEnergyRows(energy_stream_t *stream, bool blocking) {
+    while (true) {
+        int state = stream->state.load(std::memory_order_acquire);
+        if (state == streamFailed) {
+            return;
+        }
+
+        int row = stream->nextRow.load(std::memory_order_relaxed);
+        bool ready = false;
+        if (state == streamStarted) {
+            if (row >= stream->height) {
+                return;
+            }
+            int rowsNeeded = std::min(row + 2, stream->height);
+            ready = stream->rowsDecoded.load(std::memory_order_acquire) >= rowsNeeded;
+        }
+
+        if (!ready) {
+            if (!blocking) {
+                return;
+            }
+            std::this_thread::yield();
+            continue;
+        }
+
+        if (stream->nextRow.compare_exchange_weak(row, row + 1)) {
+            calculateEnergyForRow<HorizontalEnergy>(stream->pixels, stream->energy, row,
+                                                    stream->width, stream->height, stream->width);
+        }
+    }
+}
+
+
+// png_row_listener_t callbacks for energy_stream_t.
+uint8_t *energyStreamBegin(void *context, int width, int height) {
+    energy_stream_t *stream = (energy_stream_t *)context;
+    stream->pixels = (pixel *)calloc(width * height, sizeof(pixel));
+    stream->energy = (double *)calloc(width * height, sizeof(double));
+    if (!stream->pixels || !stream->energy) {
+        return NULL;
+    }
+
+    stream->width = width;
+    stream->height = height;
+    stream->state.store(streamStarted, std::memory_order_release);
+    return (uint8_t *)stream->pixels;
+}
+
+void energyStreamRow(void *context, int row) {
+    energy_stream_t *stream = (energy_stream_t *)context;
+    stream->rowsDecoded.store(row + 1, std::memory_order_release);
+    if (stream->decoderComputesEnergy) {
+        drainEnergyRows(stream, false);
+    }
+}
+
+
+// Decodes a PNG into a newly allocated pixel array and computes its energy
+// matrix at the same time. One thread inflates rows while the others
+// compute the energy of rows that have already arrived, so the energy is
+// ready as soon as decoding finishes. Returns NULL if it can't be read.
+pixel *readImagePNGWithEnergy(const char *filename, int *width, int *height, double **energy) {
+    energy_stream_t stream;
+    stream.pixels = NULL;
+    stream.energy = NULL;
+    stream.width = 0;
+    stream.height = 0;
+    stream.decoderComputesEnergy = (omp_get_max_threads() == 1);
+    stream.state.store(streamWaiting);
+    stream.rowsDecoded.store(0);
+    stream.nextRow.store(0);
+
+    png_row_listener_t listener;
+    listener.begin = energyStreamBegin;
+    listener.row = energyStreamRow;
+    listener.context = &stream;
+
+    bool decoded = false;
+
+    #pragma omp parallel
+    {
+        if (omp_get_thread_num() == 0) {
+            decoded = (png_to_packed_rgb_rows(filename, width, height, &listener) != NULL);
+            if (!decoded) {
+                stream.state.store(streamFailed, std::memory_order_release);
+            }
+        }
+
+        // Once decoding is done, the decoding thread helps with what's left.
+        drainEnergyRows(&stream, true);
+    }
+
+    if (!decoded) {
+        free(stream.pixels);
+        free(stream.energy);
+        return NULL;
+    }
+
+    *energy = stream.energy;
+    return stream.pixels;
+}
+#endif
+
+
+// Reads the image at filename into a newly allocated pixel array, picking
+// the format from the file extension. Returns NULL if it can't be read.
+// If energy isn't NULL and the reader can compute the energy matrix while
+// it decodes (PNG only), *energy is set to a newly allocated energy matrix,
+// otherwise it's set to NULL.
+pixel *readImage(const char *filename, int *width, int *height, double **energy) {
+    if (energy) {
+        *energy = NULL;
+    }
+    if (hasExtension(filename, ".raw")) {
+        return (pixel *)raw_image_read(filename, width, height);
+    }
+#ifdef USE_LIBPNG
+    if (hasExtension(filename, ".png")) {
+        if (energy) {
+            return readImagePNGWithEnergy(filename, width, height, energy);
+        }
+        return (pixel *)png_to_packed_rgb(filename, width, height);
+    }
+#endif
+    return readImageText(filename, width, height);
+}
+
+
+// Writes our pixel array to filename, picking the format from the
+// file extension.
+bool writeImage(const char *filename, pixel *pixels, int width, int height) {
+    if (hasExtension(filename, ".raw")) {
+        return raw_image_write(filename, (uint8_t *)pixels, width, height);
+    }
+#ifdef USE_LIBPNG
+    if (hasExtension(filename, ".png")) {
+        return packed_rgb_to_png_parallel((uint8_t *)pixels, width, height, filename, pngOptions);
+    }
+#endif
+    return writeImageText(filename, pixels, width, height);
+}
+
+
+// Returns the output file name to use for an input file when -o isn't
+// given: outputImage in the same format as the input.
+const char *defaultOutputFilename(const char *input_filename) {
+    if (hasExtension(input_filename, ".raw")) {
+        return "outputImage.raw";
+    }
+#ifdef USE_LIBPNG
+    if (hasExtension(input_filename, ".png")) {
+        return "outputImage.png";
+    }
+#endif
+    return "outputImage.txt";
+}
+
+
+// Returns true if we know how to read the file, going by its extension.
+bool isSupportedImage(const char *filename) {
+#ifdef USE_LIBPNG
+    if (hasExtension(filename, ".png")) {
+        return true;
+    }
+#endif
+    return hasExtension(filename, ".raw") || hasExtension(filename, ".txt");
+}
+
+
+// Reads an image's dimensions without reading the image.
+bool readImageSize(const char *filename, int *width, int *height) {
+    if (hasExtension(filename, ".raw")) {
+        return raw_image_read_size(filename, width, height);
+    }
+
+    FILE *input = fopen(filename, "rb");
+    if (!input) {
+        return false;
+    }
+
+    bool ok;
+    if (hasExtension(filename, ".png")) {
+        // The IHDR chunk always comes first: 8 byte signature, 8 bytes of
+        // chunk length and type, then big-endian width and height.
+        uint8_t header[24];
+        ok = (fread(header, 1, sizeof(header), input) == sizeof(header));
+        *width = (header[16] << 24) | (header[17] << 16) | (header[18] << 8) | header[19];
+        *height = (header[20] << 24) | (header[21] << 16) | (header[22] << 8) | header[23];
+    } else {
+        ok = (fscanf(input, "%d %d", width, height) == 2);
+    }
+
+    fclose(input);
+    return ok;
+}
+
+
+// Builds the list of images for batch mode. path is either a directory, in
+// which case every image in it is used, or a manifest with one image path
+// per line (blank lines and lines starting with # are skipped).
+bool listBatchImages(const char *path, std::vector<std::string> &images) {
+    DIR *directory = opendir(path);
+    if (directory) {
+        struct dirent *entry;
+        while ((entry = readdir(directory)) != NULL) {
+            if (entry->d_name[0] != '.' && isSupportedImage(entry->d_name)) {
+                images.push_back(std::string(path) + "/" + entry->d_name);
+            }
+        }
+        closedir(directory);
+        std::sort(images.begin(), images.end());
+        return true;
+    }
+
+    FILE *manifest = fopen(path, "r");
+    if (!manifest) {
+        return false;
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), manifest)) {
+        size_t length = strcspn(line, "\r\n");
+        line[length] = '\0';
+        if (length > 0 && line[0] != '#') {
+            images.push_back(line);
+        }
+    }
+    fclose(manifest);
+    return true;
+}
+
+
+// Gives every batch image its own output path in outputDirectory:
+// the input's name with _carved added before the extension, plus the
+// image's position in the batch if two inputs share a name.
+std::vector<std::string> batchOutputPaths(const std::vector<std::string> &images,
+                                          const char *outputDirectory) {
+    std::vector<std::string> outputs;
+    for (size_t i = 0; i < images.size(); i++) {
+        std::string name = images[i].substr(images[i].find_last_of('/') + 1);
+        size_t dot = name.find_last_of('.');
+        std::string stem = (dot == std::string::npos) ? name : name.substr(0, dot);
+        std::string extension = (dot == std::string::npos) ? "" : name.substr(dot);
+
+        std::string output = std::string(outputDirectory) + "/" + stem + "_carved" + extension;
+        if (std::find(outputs.begin(), outputs.end(), output) != outputs.end()) {
+            output = std::string(outputDirectory) + "/" + stem + "_carved_" +
+                     std::to_string(i) + extension;
+        }
+        outputs.push_back(output);
+    }
+    return outputs;
+}
+
+
+// An image on its way through the batch pipeline.
+typedef struct
+{
+	int index;
+	pixel *pixels;
+	double *energy;
+	int width;
+	int height;
+	int newWidth;
+	int newHeight;
+	int threads;
+	double compute_time;
+} batch_item_t;
+
+
+// A blocking queue with a fixed capacity between two pipeline stages.
+// push blocks while the queue is full, which caps how many images can be
+// in memory at once. pop blocks while it's empty, and returns false once
+// the queue has been closed and drained.
+typedef struct
+{
+	std::mutex lock;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+	std::deque<batch_item_t> items;
+	size_t capacity;
+	bool closed;
+} batch_queue_t;
+
+void batchQueuePush(batch_queue_t *queue, const batch_item_t &item) {
+    std::unique_lock<std::mutex> guard(queue->lock);
+    queue->notFull.wait(guard, [queue] { return queue->items.size() < queue->capacity; });
+    queue->items.push_back(item);
+    queue->notEmpty.notify_one();
+}
+
+bool batchQueuePop(batch_queue_t *queue, batch_item_t *item) {
+    std::unique_lock<std::mutex> guard(queue->lock);
+    queue->notEmpty.wait(guard, [queue] { return !queue->items.empty() || queue->closed; });
+    if (queue->items.empty()) {
+        return false;
+    }
+    *item = queue->items.front();
+    queue->items.pop_front();
+    queue->notFull.notify_one();
+    return true;
+}
+
+void batchQueueClose(batch_queue_t *queue) {
+    std::lock_guard<std::mutex> guard(queue->lock);
+    queue->closed = true;
+    queue->notEmpty.notify_all();
+}
+
+
+// Carves every image listed by batchPath in this one process, writing the
+// results to outputDirectory.
+//
+// Our num_of_threads cores are split between carving several images at
+// once and the OpenMP parallelism within each image. Going by the median
+// image size, each image gets about one thread per BATCH_PIXELS_PER_THREAD
+// pixels, and the rest of the cores go to running that many images side
+// by side. Workers take the next image as they finish, and images smaller
+// than the median use fewer threads of their own.
+//
+// File I/O overlaps with carving in a three stage pipeline. A reader
+// thread prefetches and decodes the next images, the workers carve, and a
+// writer thread encodes and writes finished images. The stages are joined
+// by queues that hold one image per worker, so at most about three images
+// per worker are in memory at once. The reader and writer use ioThreads
+// OpenMP threads each for decoding and encoding.
+int runBatch(const char *batchPath, const char *outputDirectory, int num_of_threads,
+             const carve_options_t &options, int ioThreads) {
+    using namespace std::chrono;
+    typedef std::chrono::high_resolution_clock Clock;
+    typedef std::chrono::duration<double> dsec;
+
+    auto batch_start = Clock::now();
+
+    std::vector<std::string> images;
+    if (!listBatchImages(batchPath, images)) {
+        printf("Unable to open batch: %s.\n", batchPath);
+        return 1;
+    }
+    if (images.empty()) {
+        printf("No images in batch: %s.\n", batchPath);
+        return 1;
+    }
+    std::vector<std::string> outputs = batchOutputPaths(images, outputDirectory);
+
+    // Size our workers for the median image.
+    std::vector<long> imagePixels;
+    for (size_t i = 0; i < images.size(); i++) {
+        int width, height;
+        if (readImageSize(images[i].c_str(), &width, &height)) {
+            imagePixels.push_back((long)width * height);
+        }
+    }
+    long medianPixels = BATCH_PIXELS_PER_THREAD;
+    if (!imagePixels.empty()) {
+        std::nth_element(imagePixels.begin(), imagePixels.begin() + imagePixels.size() / 2, imagePixels.end());
+        medianPixels = imagePixels[imagePixels.size() / 2];
+    }
+
+    int threadsPerImage = (int)std::max(1L, std::min((long)num_of_threads, medianPixels / BATCH_PIXELS_PER_THREAD));
+    int workers = std::max(1, std::min(num_of_threads / threadsPerImage, (int)images.size()));
+
+    printf("Batch: %d images, %d workers with up to %d threads each\n",
+           (int)images.size(), workers, threadsPerImage);
+
+    batch_queue_t readQueue;
+    readQueue.capacity = workers;
+    readQueue.closed = false;
+
+    batch_queue_t writeQueue;
+    writeQueue.capacity = workers;
+    writeQueue.closed = false;
+
+    std::atomic<int> failures(0);
+    double read_busy = 0;
+    double carve_busy = 0;
+    double write_busy = 0;
+
+    // Reader stage: decode images in order, waiting whenever the workers
+    // already have an image queued each.
+    std::thread reader([&] {
+        omp_set_num_threads(ioThreads);
+        for (int i = 0; i < (int)images.size(); i++) {
+            auto read_start = Clock::now();
+            batch_item_t item;
+            item.index = i;
+            item.energy = NULL;
+            item.pixels = readImage(images[i].c_str(), &item.width, &item.height,
+                                    carveUsesReadEnergy(options) ? &item.energy : NULL);
+            read_busy += duration_cast<dsec>(Clock::now() - read_start).count();
+
+            if (!item.pixels) {
+                printf("Unable to open file: %s.\n", images[i].c_str());
+                failures++;
+                continue;
+            }
+            batchQueuePush(&readQueue, item);
+        }
+        batchQueueClose(&readQueue);
+    });
+
+    // Writer stage: encode and write images as the workers finish them.
+    std::thread writer([&] {
+        omp_set_num_threads(ioThreads);
+        batch_item_t item;
+        while (batchQueuePop(&writeQueue, &item)) {
+            const char *output = outputs[item.index].c_str();
+            auto write_start = Clock::now();
+            bool written = writeImage(output, item.pixels, item.newWidth, item.newHeight);
+            free(item.pixels);
+            write_busy += duration_cast<dsec>(Clock::now() - write_start).count();
+
+            if (written) {
+                printf("%s: %dx%d -> %dx%d, %d threads, Computation Time: %lf -> %s\n",
+                       images[item.index].c_str(), item.width, item.height, item.newWidth, item.newHeight,
+                       item.threads, item.compute_time, output);
+            } else {
+                printf("Unable to write file: %s.\n", output);
+                failures++;
+            }
+        }
+    });
+
+    // Carve stage: our workers, each carving one image at a time with its
+    // own nested OpenMP team.
+    omp_set_max_active_levels(2);
+
+    #pragma omp parallel num_threads(workers) reduction(+:carve_busy)
+    {
+        batch_item_t item;
+        while (batchQueuePop(&readQueue, &item)) {
+
+            // Give the image a thread per BATCH_PIXELS_PER_THREAD pixels,
+            // up to this worker's share.
+            long pixelCount = (long)item.width * item.height;
+            item.threads = (int)std::max(1L, std::min((long)threadsPerImage, pixelCount / BATCH_PIXELS_PER_THREAD));
+            omp_set_num_threads(item.threads);
+
+            auto compute_start = Clock::now();
+            item.newWidth = carveImage2D(item.pixels, item.energy, item.width, item.height, options, NULL,
+                                         &item.newHeight);
+            item.energy = NULL;
+            item.compute_time = duration_cast<dsec>(Clock::now() - compute_start).count();
+            carve_busy += item.compute_time;
+
+            batchQueuePush(&writeQueue, item);
+        }
+    }
+
+    batchQueueClose(&writeQueue);
+    reader.join();
+    writer.join();
+
+    // How busy each stage was over the whole batch. Whichever stage is
+    // closest to 100% is the one limiting our throughput.
+    double batch_time = duration_cast<dsec>(Clock::now() - batch_start).count();
+    printf("Read Stage: %lf (%.1lf%% busy).\n", read_busy, 100.0 * read_busy / batch_time);
+    printf("Carve Stage: %lf (%.1lf%% busy across %d workers).\n",
+           carve_busy, 100.0 * carve_busy / (batch_time * workers), workers);
+    printf("Write Stage: %lf (%.1lf%% busy).\n", write_busy, 100.0 * write_busy / batch_time);
+    printf("Batch Time: %lf (%.2lf images/s).\n", batch_time, images.size() / batch_time);
+
+    return (failures > 0) ? 1 : 0;
+}
+
+
+
+int main(int argc, const char *argv[])
+{
+  using namespace std::chrono;
+  typedef std::chrono::high_resolution_clock Clock;
+  typedef std::chrono::duration<double> dsec;
+
+  auto init_start = Clock::now();
+  double init_time = 0;
+ 
+  _argc = argc - 1;
+  _argv = argv + 1;
+
+  const char *input_filename = get_option_string("-f", NULL);
+  const char *output_filename = get_option_string("-o", NULL);
+  int num_of_threads = get_option_int("-n", 1);
+
+  carve_options_t options;
+  options.seamCount = get_option_int("-s", SEAM_COUNT);
+  options.integerEnergy = (get_option_int("-int", 0) != 0);
+  options.floatEnergy = (get_option_int("-float", 0) != 0);
+  options.forwardEnergy = (get_option_int("-forward", 0) != 0);
+  options.incrementalACM = (get_option_int("-incremental", 0) != 0);
+
+  // -hs COUNT also takes COUNT horizontal seams out, in the order
+  // -seamorder picks: phases (the default), alternate or greedy.
+  options.horizontalSeamCount = get_option_int("-hs", 0);
+  options.seamOrder = seamOrderPhases;
+  const char *order_name = get_option_string("-seamorder", NULL);
+  if (order_name) {
+    options.seamOrder = -1;
+    for (int order = 0; order < seamOrderCount; order++) {
+      if (!strcasecmp(order_name, seamOrderNames[order])) {
+        options.seamOrder = order;
+      }
+    }
+    if (options.seamOrder < 0) {
+      printf("Unknown seam order: %s.\n", order_name);
+      return 1;
+    }
+  }
+
+  // -pyramid LEVELS finds seams on the image shrunk by 2^LEVELS, and
+  // -pyramidband N is how far either side of them the full size ACM goes.
+  options.pyramidLevels = std::max(0, get_option_int("-pyramid", 0));
+  options.pyramidBand = std::max(1, get_option_int("-pyramidband", 8));
+
+  // -lazy 1 takes seams out of an index of each row instead of the pixels,
+  // and packs the rows once more than -compact PERCENT of each is gone.
+  options.lazyRemoval = (get_option_int("-lazy", 0) != 0);
+  options.lazyCompact = std::max(0, std::min(100, get_option_int("-compact", 50)));
+
+  // -k N takes N seams out of each ACM instead of one.
+  options.seamsPerPass = std::max(1, get_option_int("-k", 1));
+
+  // How seams pick their roots: exact (the default), or bands for the
+  // band-approximate ACM, with -halo rows above each band.
+  options.seamRoot = seamRootExact;
+  options.haloRows = std::max(0, get_option_int("-halo", 16));
+  const char *root_name = get_option_string("-root", NULL);
+  if (root_name) {
+    options.seamRoot = -1;
+    for (int root = 0; root < seamRootCount; root++) {
+      if (!strcasecmp(root_name, seamRootNames[root])) {
+        options.seamRoot = root;
+      }
+    }
+    if (options.seamRoot < 0) {
+      printf("Unknown seam root: %s.\n", root_name);
+      return 1;
+    }
+  }
+
+  // How seams are traced back up: by walking the ACM (the default), or
+  // from a table of each entry's parent, which only keeps a ring of rows
+  // of the ACM itself.
+  options.backtrack = seamBacktrackACM;
+  const char *backtrack_name = get_option_string("-backtrack", NULL);
+  if (backtrack_name) {
+    options.backtrack = -1;
+    for (int backtrack = 0; backtrack < seamBacktrackCount; backtrack++) {
+      if (!strcasecmp(backtrack_name, seamBacktrackNames[backtrack])) {
+        options.backtrack = backtrack;
+      }
+    }
+    if (options.backtrack < 0) {
+      printf("Unknown seam backtrack: %s.\n", backtrack_name);
+      return 1;
+    }
+  }
+
+  // The energy function to carve with: horizontal (the default), dual,
+  // sobel or luma.
+  options.energy = energyHorizontal;
+  const char *energy_name = get_option_string("-energy", NULL);
+  if (energy_name) {
+    options.energy = -1;
+    for (int function = 0; function < energyFunctionCount; function++) {
+      if (!strcasecmp(energy_name, energyFunctionNames[function])) {
+        options.energy = function;
+      }
+    }
+    if (options.energy < 0) {
+      printf("Unknown energy function: %s.\n", energy_name);
+      return 1;
+    }
+  }
+
+  
+  const char *batch_path = get_option_string("-b", NULL);
+
+  printf("Number of threads: %d\n", num_of_threads);
+  if (!batch_path) {
+    printf("Input file: %s\n", input_filename);
+  }
+
+#ifdef USE_LIBPNG
+  // PNG output settings: zlib level 0-9 and the row filter to use
+  // (none, sub, up, avg, paeth or adaptive).
+  pngOptions.level = get_option_int("-z", pngOptions.level);
+  const char *png_filter_name = get_option_string("-pngfilter", NULL);
+  if (png_filter_name) {
+    pngOptions.filter = png_filter_from_name(png_filter_name);
+    if (pngOptions.filter < 0) {
+      printf("Unknown PNG filter: %s.\n", png_filter_name);
+      return 1;
+    }
+  }
+#endif
+
+  // Pick the energy kernel. By default it's the fastest one the CPU has,
+  // but -energykernel scalar, sse4.1 or avx2 can ask for a particular one.
+  int energy_kernel = bestEnergyKernel();
+  const char *energy_kernel_name = get_option_string("-energykernel", NULL);
+  if (energy_kernel_name) {
+    energy_kernel = energyKernelFromName(energy_kernel_name);
+    if ((energy_kernel < 0) || !energyKernelAvailable(energy_kernel)) {
+      printf("Energy kernel not available: %s.\n", energy_kernel_name);
+      return 1;
+    }
+  }
+  energyKernel = energyKernelFunction(energy_kernel);
+  printf("Energy kernel: %s\n", energyKernelNames[energy_kernel]);
+
+  // Same for the ACM kernel: -acmkernel scalar, avx2 or avx512.
+  acmKernel = bestAcmKernel();
+  const char *acm_kernel_name = get_option_string("-acmkernel", NULL);
+  if (acm_kernel_name) {
+    acmKernel = acmKernelFromName(acm_kernel_name);
+    if ((acmKernel < 0) || !acmKernelAvailable(acmKernel)) {
+      printf("ACM kernel not available: %s.\n", acm_kernel_name);
+      return 1;
+    }
+  }
+  printf("ACM kernel: %s\n", acmKernelNames[acmKernel]);
+
+  // Batch mode carves a whole directory (or manifest) of images in this one
+  // process, writing them to the -o directory. It runs on the host only.
+  if (batch_path) {
+#ifdef RUN_MIC
+    printf("Batch mode isn't supported on the Xeon Phi build.\n");
+    return 1;
+#else
+    int io_threads = get_option_int("-iothreads", 1);
+    return runBatch(batch_path, output_filename ? output_filename : ".", num_of_threads, options,
+                    io_threads);
+#endif
+  }
+
+  // -seammap FILE also writes a seam map of the carve to FILE, and
+  // -retarget FILE -w WIDTH uses one to make the image WIDTH wide without
+  // carving (see seammap.h).
+  const char *seam_map_filename = get_option_string("-seammap", NULL);
+  const char *retarget_filename = get_option_string("-retarget", NULL);
+
+  // -insert COUNT makes the image COUNT pixels wider instead of carving it.
+  int insert_count = std::max(0, get_option_int("-insert", 0));
+  if (insert_count && (options.horizontalSeamCount > 0)) {
+    printf("Seam insertion only makes the image wider, it can't be combined with -hs.\n");
+    return 1;
+  }
+#ifdef RUN_MIC
+  if (seam_map_filename || retarget_filename || insert_count) {
+    printf("Seam maps and seam insertion aren't supported on the Xeon Phi build.\n");
+    return 1;
+  }
+#endif
+
+  // Loading the image runs on the host, so use our threads there too.
+  omp_set_num_threads(num_of_threads);
+
+
+  // Read our image. PNG input (USE_LIBPNG builds only) is decoded
+  // straight into our pixel array with its energy computed as rows arrive,
+  // anything else is read as image_rgb.txt (or .raw).
+  int width, height;
+  double *initialEnergy = NULL;
+  pixel *pixels = readImage(input_filename, &width, &height,
+                            (carveUsesReadEnergy(options) && !retarget_filename && !insert_count) ?
+                            &initialEnergy : NULL);
+
+  if (!pixels) {
+    printf("Unable to open file: %s.\n", input_filename);
+    return 1;
+  }
+
+  printf("Width: %d, Height: %d\n", width, height);
+
+
+
+  init_time += duration_cast<dsec>(Clock::now() - init_start).count();
+  printf("Initialization Time: %lf.\n", init_time);
+
+  if (!output_filename) {
+    output_filename = defaultOutputFilename(input_filename);
+  }
+
+  // Retargeting with a seam map is one gather, with no carving at all.
+  if (retarget_filename) {
+    int mapWidth, mapHeight, minWidth;
+    uint16_t *removalOrder = seam_map_read(retarget_filename, &mapWidth, &mapHeight, &minWidth);
+    if (!removalOrder) {
+      printf("Unable to open seam map: %s.\n", retarget_filename);
+      return 1;
+    }
+    int target_width = get_option_int("-w", minWidth);
+    if ((mapWidth != width) || (mapHeight != height) || (target_width < minWidth) || (target_width > width)) {
+      printf("Seam map is %dx%d down to width %d, can't make this image %d wide.\n",
+             mapWidth, mapHeight, minWidth, target_width);
+      return 1;
+    }
+
+    auto retarget_start = Clock::now();
+    pixel *output = (pixel *)malloc(sizeof(pixel) * target_width * height);
+    retargetImage(pixels, removalOrder, output, width, height, target_width);
+    printf("Retarget Time: %lf.\n", duration_cast<dsec>(Clock::now() - retarget_start).count());
+
+    if (!writeImage(output_filename, output, target_width, height)) {
+      printf("Unable to write file: %s.\n", output_filename);
+    }
+    free(output);
+    free(removalOrder);
+    free(pixels);
+    return 0;
+  }
+
+  // The image has to be wide enough to find seams in, and the wider one
+  // narrow enough for enlargeImage's seam maps.
+  if (insert_count && ((width < ENLARGE_MIN_WIDTH) || (insert_count > ENLARGE_MAX_WIDTH - width))) {
+    printf("Seam insertion needs an image at least %d wide, and can't make it more than %d wide.\n",
+           ENLARGE_MIN_WIDTH, ENLARGE_MAX_WIDTH);
+    return 1;
+  }
+
+  // Seam maps fit each pixel's order in a uint16_t.
+  uint16_t *removalOrder = NULL;
+  if (seam_map_filename) {
+    if (width >= SEAM_MAP_KEPT) {
+      printf("Image is too wide for a seam map.\n");
+      return 1;
+    }
+    if ((options.horizontalSeamCount > 0) || insert_count) {
+      printf("Seam maps only work when taking vertical seams out.\n");
+      return 1;
+    }
+    removalOrder = (uint16_t *)malloc(sizeof(uint16_t) * width * height);
+  }
+
+  // -verifyint 1 checks the integer pipeline picks the same seams as the
+  // double one on this image before we carve it for real.
+#ifndef RUN_MIC
+  if (get_option_int("-verifyint", 0)) {
+    verifyIntegerPipeline(pixels, width, height, options);
+  }
+
+  // -verifyacm 1 checks the parallel ACM matches the sequential one.
+  if (get_option_int("-verifyacm", 0)) {
+    verifyParallelACM(pixels, width, height);
+  }
+
+  // -acmbench 1 times each ACM kernel against the old rowAbove loop.
+  if (get_option_int("-acmbench", 0)) {
+    benchmarkACMKernels(pixels, width, height);
+  }
+
+  // -rootbench 1 compares exact seam roots against the bands at a few halos.
+  if (get_option_int("-rootbench", 0)) {
+    benchmarkSeamRoots(pixels, width, height, options);
+  }
+
+  // -pyramidbench 1 compares the pyramid at a few depths and bands against
+  // the full ACM.
+  if (get_option_int("-pyramidbench", 0)) {
+    benchmarkPyramid(pixels, width, height, options);
+  }
+
+  // -lazybench 1 compares lazy seam removal at a few -compact percentages
+  // against moving the pixels every seam.
+  if (get_option_int("-lazybench", 0)) {
+    benchmarkLazyRemoval(pixels, width, height, options);
+  }
+
+  // -passbench 1 compares taking several seams out of each ACM against one.
+  if (get_option_int("-passbench", 0)) {
+    benchmarkSeamsPerPass(pixels, width, height, options);
+  }
+
+  // -energybench 1 times each energy kernel and checks them against
+  // scalar, then times each energy function.
+  if (get_option_int("-energybench", 0)) {
+    benchmarkEnergyKernels(pixels, width, height);
+    benchmarkEnergyFunctions(pixels, width, height);
+  }
+#endif
+
+
+  auto compute_start = Clock::now();
+  double compute_time = 0;
+  int newWidth = width;
+  int newHeight = height;
+
+  #ifdef RUN_MIC /* Use RUN_MIC to distinguish between the target of compilation */
+
+  /* This pragma means we want the code in the following block be executed in 
+   * Xeon Phi.
+   */
+#pragma offload target(mic) \
+  inout(pixels: length(width * height) INOUT) \
+  inout(newWidth) \
+  inout(newHeight)
+#endif
+  {
+    // Set our thread count.
+    omp_set_num_threads(num_of_threads);
+
+    // The energy computed while decoding a PNG only exists on the host.
+#ifdef RUN_MIC
+    double *energy = NULL;
+#else
+    double *energy = initialEnergy;
+#endif
+
+    carve_stats_t stats;
+    if (insert_count > 0) {
+      pixels = enlargeImage(pixels, width, height, insert_count, options, &stats, &newWidth);
+    } else if (removalOrder) {
+      newWidth = carveImage(pixels, energy, width, height, options, &stats, removalOrder);
+    } else {
+      newWidth = carveImage2D(pixels, energy, width, height, options, &stats, &newHeight);
+    }
+
+    // Print our timing results
+    printf("ACM Time: %lf.\n", stats.acm);
+    printf("Generate Time: %lf.\n", stats.generate);
+    printf("Remove Time: %lf.\n", stats.remove);
+    printf("Removed Seam Energy: %lf.\n", stats.seamEnergy);
+    if (options.incrementalACM || (options.pyramidLevels > 0)) {
+      printf("ACM Entries Computed: %.1lf%%.\n", 100.0 * stats.acmFraction);
+    }
+    if (options.seamsPerPass > 1) {
+      printf("ACM Passes: %d.\n", stats.acmPasses);
+    }
+    if (options.horizontalSeamCount > 0) {
+      printf("Transpose Time: %lf.\n", stats.transpose);
+    }
+    if (insert_count > 0) {
+      printf("Insert Time: %lf.\n", stats.insert);
+    }
+  }
+
+
+
+  compute_time += duration_cast<dsec>(Clock::now() - compute_start).count();
+  printf("Computation Time: %lf.\n", compute_time);
+
+
+  if (removalOrder) {
+    if (!seam_map_write(seam_map_filename, removalOrder, width, height, newWidth)) {
+      printf("Unable to write seam map: %s.\n", seam_map_filename);
+    }
+    free(removalOrder);
+  }
 
-  // Write a new outputImage.txt file with our resulting image.
-  FILE *outputFile = fopen("outputImage.txt", "w");
-  fprintf(outputFile, "%d %d\n", newWidth, height);
-  for (int i = 0; i < newWidth * height; i++) {
-    fprintf(outputFile, "%d %d %d\n", (int)pixels[i].r, (int)pixels[i].g, (int)pixels[i].b);
+  // Write out our resulting image. Unless -o names the file, we write it in
+  // the same format we read it in, by default a new outputImage.txt file.
+  auto write_start = Clock::now();
+  if (!writeImage(output_filename, pixels, newWidth, newHeight)) {
+    printf("Unable to write file: %s.\n", output_filename);
+  } else {
+    printf("Write Time: %lf.\n", duration_cast<dsec>(Clock::now() - write_start).count());
   }
-  fclose(outputFile);
 
   free(pixels);
   return 0;